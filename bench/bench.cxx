@@ -0,0 +1,327 @@
+// bar-bench: packs, lists and unpacks reproducible synthetic trees and
+// prints one JSON object per phase. Trees are generated once under the root
+// directory and reused by later runs with the same scale; only the archive
+// and the extracted copy are rebuilt.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <bar.hxx>
+#include <format>
+
+#include <sys/resource.h>
+
+#include "utils/argh.h"
+
+namespace fs = std::filesystem;
+
+constexpr auto USAGE =
+    R"(usage: bar-bench [options] [workloads...]
+    workloads:
+      tiny             A million files of under 1 KiB
+      deep             Files spread over directories nested 100 deep
+      large            Three files of 2 GiB: random, text and mostly zeros
+      mixed            Sizes from bytes to 64 MiB, half text, half random
+    options:
+     -r, --root DIR    Generate trees and archives here (default: bar-bench.d)
+     -s, --scale F     Multiply file counts and sizes by F (default: 1)
+     -j, --jobs N      Use N threads to pack and for the parallel unpack
+     -z, --compress    Pack with lz compression
+     -d, --dedup       Pack with chunk deduplication
+     -c, --checksum    Pack with checksums
+     -a, --align       Pack with aligned payloads
+     -h, --help        Show this help message
+    )";
+
+// splitmix64, the trees must not depend on the platform's <random>
+struct rng {
+  uint64_t state;
+
+  auto next() -> uint64_t {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+  auto below(uint64_t n) -> uint64_t { return n ? next() % n : 0; }
+};
+
+enum struct fill { text, random, zeros };
+
+// Writes `size` bytes of `kind` content, in 1 MiB pieces.
+void make_file(const fs::path& path, uint64_t size, fill kind, rng& gen) {
+  constexpr std::string_view WORDS[] = {
+      "the ",   "archive ", "bar ",   "of ",    "file ",   "and ",  "data ", "block ",
+      "entry ", "index ",   "path ",  "with ",  "chunk ",  "to ",   "{\n",   "}\n",
+      "int ",   "return ",  "0, ",    "1, ",    "\"key\"", ": ",    "null ", "true ",
+      "std::",  "vector ",  "size ",  "const ", "auto ",   "void ", "\t",    "\n"};
+
+  std::ofstream out(path, std::ios::binary);
+  std::string buf;
+  while (size > 0) {
+    const auto n = std::min<uint64_t>(size, 1 << 20);
+    buf.clear();
+    switch (kind) {
+      case fill::text:
+        while (buf.size() < n) {
+          buf += WORDS[gen.below(std::size(WORDS))];
+        }
+        buf.resize(n);
+        break;
+      case fill::random:
+        buf.resize(n);
+        for (size_t i = 0; i < n; i += 8) {
+          const auto val = gen.next();
+          std::memcpy(buf.data() + i, &val, std::min<size_t>(8, n - i));
+        }
+        break;
+      case fill::zeros:
+        buf.assign(n, '\0');
+        if (n >= 5 && gen.below(16) == 0)
+          buf.replace(0, 5, "bar\n\n");
+        break;
+    }
+    out.write(buf.data(), static_cast<std::streamsize>(n));
+    size -= n;
+  }
+}
+
+void make_tiny(const fs::path& root, double scale, rng& gen) {
+  const auto count = static_cast<uint64_t>(1'000'000 * scale);
+  for (uint64_t i = 0; i < count; ++i) {
+    const auto dir = root / std::format("d{:04}", i / 1000);
+    if (i % 1000 == 0)
+      fs::create_directories(dir);
+    make_file(dir / std::format("f{:07}", i), gen.below(1024), fill::text, gen);
+  }
+}
+
+void make_deep(const fs::path& root, double scale, rng& gen) {
+  const auto chains = std::max<uint64_t>(1, static_cast<uint64_t>(64 * scale));
+  for (uint64_t c = 0; c < chains; ++c) {
+    auto dir = root / std::format("c{:03}", c);
+    for (int depth = 0; depth < 100; ++depth) {
+      dir /= std::format("l{:02}", depth);
+      fs::create_directories(dir);
+      for (int i = 0; i < 4; ++i) {
+        make_file(dir / std::format("f{}", i), gen.below(16 << 10), fill::text, gen);
+      }
+    }
+  }
+}
+
+void make_large(const fs::path& root, double scale, rng& gen) {
+  const auto size = static_cast<uint64_t>((2ull << 30) * scale);
+  fs::create_directories(root);
+  make_file(root / "random.bin", size, fill::random, gen);
+  make_file(root / "text.txt", size, fill::text, gen);
+  make_file(root / "zeros.img", size, fill::zeros, gen);
+}
+
+void make_mixed(const fs::path& root, double scale, rng& gen) {
+  const auto count = static_cast<uint64_t>(20'000 * scale);
+  for (uint64_t i = 0; i < count; ++i) {
+    const auto dir = root / std::format("p{:02}", i % 20) / std::format("q{:02}", i / 20 % 20);
+    if (i < 400)
+      fs::create_directories(dir);
+
+    // 60% under 4 KiB, 30% up to 256 KiB, 9% up to 8 MiB, 1% up to 64 MiB
+    const auto roll = gen.below(100);
+    const uint64_t cap = roll < 60   ? 4 << 10
+                         : roll < 90 ? 256 << 10
+                         : roll < 99 ? 8 << 20
+                                     : 64 << 20;
+    const auto kind = i % 2 ? fill::text : fill::random;
+    make_file(dir / std::format("m{:06}", i), gen.below(cap), kind, gen);
+  }
+}
+
+struct workload {
+  std::string_view name;
+  void (*make)(const fs::path&, double, rng&);
+};
+
+constexpr workload WORKLOADS[] = {
+    {"tiny", make_tiny}, {"deep", make_deep}, {"large", make_large}, {"mixed", make_mixed}};
+
+// Peak RSS since the last call, in KiB. Linux resets the high water mark
+// through clear_refs; elsewhere this is the peak of the whole process.
+auto peak_rss_kb() -> uint64_t {
+  uint64_t peak = 0;
+  std::ifstream status("/proc/self/status");
+  for (std::string line; std::getline(status, line);) {
+    if (line.starts_with("VmHWM:"))
+      peak = std::stoull(line.substr(6));
+  }
+  if (!status.is_open()) {
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    peak = static_cast<uint64_t>(usage.ru_maxrss);
+  }
+  std::ofstream("/proc/self/clear_refs") << "5";
+  return peak;
+}
+
+struct totals {
+  uint64_t files = 0;
+  uint64_t bytes = 0;
+};
+
+auto measure(const fs::path& tree) -> totals {
+  totals t;
+  for (const auto& it : fs::recursive_directory_iterator(tree)) {
+    t.files++;
+    if (it.is_regular_file())
+      t.bytes += it.file_size();
+  }
+  return t;
+}
+
+// Runs `fn` and prints its timing as one JSON line.
+void phase(std::string_view work, std::string_view name, const totals& t,
+           const std::function<void()>& fn) {
+  peak_rss_kb();
+  const auto start = std::chrono::steady_clock::now();
+  fn();
+  const std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+  const auto secs = std::max(took.count(), 1e-9);
+
+  std::cout << std::format(
+                   R"({{"workload":"{}","phase":"{}","files":{},"bytes":{},"seconds":{:.6f},)"
+                   R"("mb_per_s":{:.2f},"files_per_s":{:.1f},"peak_rss_kb":{}}})",
+                   work, name, t.files, t.bytes, secs, t.bytes / secs / 1e6, t.files / secs,
+                   peak_rss_kb())
+            << std::endl;
+}
+
+void run(const workload& work, const fs::path& root, double scale, bar::pack_options opts) {
+  const auto base = root / std::format("{}-{}", work.name, scale);
+  const auto tree = base / "tree";
+  const auto done = base / ".done";
+  if (!fs::exists(done)) {
+    fs::remove_all(base);
+    fs::create_directories(tree);
+    rng gen{bar::hash::xxh64(work.name.data(), work.name.size())};
+    work.make(tree, scale, gen);
+    std::ofstream{done};
+  }
+
+  const auto t = measure(tree);
+  const auto archive = base / "tree.bar";
+  const auto out = base / "out";
+
+  phase(work.name, "pack", t, [&] {
+    bar::io::fd_sink out(bar::sys::open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644), archive);
+    bar::bottle b(out, opts);
+    b.append(tree);
+    b.finish();
+  });
+
+  phase(work.name, "list", t, [&] {
+    bar::io::fd_source in(bar::sys::open(archive, O_RDONLY), archive);
+    bar::opener op(in);
+    bar::listing batch;
+    std::string lines;
+    while (op.list(batch, 64 << 10) > 0) {
+      for (size_t i = 0; i < batch.size(); ++i) {
+        std::format_to(std::back_inserter(lines), "{} {}\t\t{}\n",
+                       batch.type(i) == bar::entry_type::dir ? 'd' : '-', batch.raw(i),
+                       batch.path(i));
+      }
+      lines.clear();
+      batch.clear();
+    }
+  });
+
+  fs::remove_all(out);
+  phase(work.name, "unpack", t, [&] {
+    bar::io::fd_source in(bar::sys::open(archive, O_RDONLY), archive);
+    bar::opener op(in);
+    bar::target dest(out);
+    while (auto entry = op.next_entry()) {
+      op.unpack(*entry, dest);
+    }
+    dest.finish();
+  });
+
+  if (opts.jobs > 1) {
+    fs::remove_all(out);
+    phase(work.name, "unpack-parallel", t, [&] {
+      bar::io::fd_source in(bar::sys::open(archive, O_RDONLY), archive);
+      bar::opener op(in);
+      bar::target dest(out);
+      bar::extractor ex(archive, dest, opts.jobs);
+      if (const auto* index = op.index()) {
+        for (const auto& rec : index->records()) {
+          if (index->is_live(rec))
+            ex.unpack(rec.to_entry(), rec.offset);
+        }
+      } else {
+        while (auto entry = op.next_entry()) {
+          ex.unpack(*entry, op.tell());
+          op.skip(*entry);
+        }
+      }
+      ex.wait();
+      dest.finish();
+    });
+  }
+
+  fs::remove_all(out);
+  fs::remove(archive);
+}
+
+auto main(int argc, char* argv[]) -> int {
+  std::ios_base::sync_with_stdio(false);
+
+  argh::parser cmdl({"-r", "--root", "-s", "--scale", "-j", "--jobs"});
+  cmdl.parse(argc, argv);
+
+  if (cmdl[{"-h", "--help"}]) {
+    std::cout << USAGE;
+    return EXIT_SUCCESS;
+  }
+
+  fs::path root;
+  cmdl({"-r", "--root"}, "bar-bench.d") >> root;
+  double scale;
+  cmdl({"-s", "--scale"}, 1.0) >> scale;
+
+  bar::pack_options opts;
+  cmdl({"-j", "--jobs"}, 0) >> opts.jobs;
+  if (!opts.jobs)
+    opts.jobs = bar::pool::concurrency();
+  opts.compress = cmdl[{"-z", "--compress"}];
+  opts.dedup = cmdl[{"-d", "--dedup"}];
+  opts.checksum = cmdl[{"-c", "--checksum"}];
+  opts.align = cmdl[{"-a", "--align"}];
+
+  std::vector<const workload*> chosen;
+  for (size_t i = 1; i < cmdl.pos_args().size(); ++i) {
+    const auto& name = cmdl.pos_args()[i];
+    const auto it = std::ranges::find(WORKLOADS, name, &workload::name);
+    if (it == std::end(WORKLOADS)) {
+      std::cerr << "unknown workload '" << name << "'.\n" << USAGE;
+      return EXIT_FAILURE;
+    }
+    chosen.push_back(it);
+  }
+  if (chosen.empty()) {
+    for (const auto& work : WORKLOADS) {
+      chosen.push_back(&work);
+    }
+  }
+
+  for (const auto* work : chosen) {
+    run(*work, root, scale, opts);
+  }
+  return EXIT_SUCCESS;
+}
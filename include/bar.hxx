@@ -2,3 +2,10 @@
 
 #include "bottle.hxx"
 #include "opener.hxx"
+#include "extractor.hxx"
+#include "mapped.hxx"
+#include "glob.hxx"
+#include "listing.hxx"
+#include "io.hxx"
+#include "stats.hxx"
+#include "target.hxx"
@@ -1,93 +1,935 @@
 #pragma once
 
+#include <algorithm>
+#include <climits>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "cdc.hxx"
+#include "codec.hxx"
+#include "crc.hxx"
 #include "header.hxx"
 #include "entry.hxx"
+#include "glob.hxx"
+#include "hash.hxx"
+#include "index.hxx"
+#include "io.hxx"
+#include "lz.hxx"
+#include "pool.hxx"
+#include "stats.hxx"
 #include "sys.hxx"
+#include "walker.hxx"
+
+#include <sys/stat.h>
 
 namespace fs = std::filesystem;
-namespace chrono = std::chrono;
 
 namespace bar {
 
+struct pack_options {
+  size_t jobs = pool::concurrency();  // threads walking, compressing and copying
+  bool compress = false;              // store regular files as lz blocks
+  bool dedup = false;                 // store repeated chunks once, wins over `compress`
+  bool checksum = false;              // follow every payload with its crc32c
+  bool align = false;                 // start plain payloads of a block or more on `ALIGN`
+  bar::format format = format::v2;    // layout of headers and index records
+  bar::stats* stats = nullptr;        // counters and timers, if wanted
+  // told the path of every file left out because it can't be read, and why
+  std::function<void(std::string_view path, std::string_view why)> on_skip;
+};
+
 class bottle {
-  std::ostream& output_;
+  io::sink& output_;
+  pack_options opts_;
+  std::unique_ptr<pool> pool_;
+  uint64_t offset_ = 0;
+  uint64_t data_at_ = 0;  // payload of the entry being written
+  uint64_t raw_ = 0;      // size of its file, see `codec::raw`
 
- public:
-  explicit bottle(std::ostream& output) : output_(output) {
-    output_.write(reinterpret_cast<const char*>(&BAR), sizeof(BAR));
-  }
+  codec stream_;  // headers in the archive
+  codec records_;  // records in `index_`
+  std::vector<char> head_;
+  std::vector<char> index_;
+  uint64_t count_ = 0;
+  uint64_t skipped_ = 0;
+  bool finished_ = false;
 
-  auto write_file(const fs::path& full_path, const fs::path& rel_path) -> bool {
-    std::string path_str = rel_path.generic_string();
+  struct chunk_key {
+    uint64_t lo, hi;  // two independent hashes, collisions are not an option
+    uint32_t size;
 
-    if (path_str.size() > entry::MAX_NAME)
-      return false;
+    bool operator==(const chunk_key&) const = default;
+  };
+  struct chunk_hash {
+    auto operator()(const chunk_key& key) const -> size_t { return key.lo; }
+  };
+  // offsets of the bytes of every chunk stored so far
+  std::unordered_map<chunk_key, uint64_t, chunk_hash> chunks_;
 
-    header_t header;
+  struct inode {
+    dev_t dev;
+    ino_t ino;
 
-    header.path = path_str.size();
-    header.data = 0;
+    bool operator==(const inode&) const = default;
+  };
+  struct inode_hash {
+    auto operator()(const inode& key) const -> size_t { return key.ino ^ (key.dev << 32); }
+  };
+  // first path of every file with more than one link, later ones become `link`s
+  std::unordered_map<inode, std::string, inode_hash> links_;
+  std::vector<char> stage_;
+  std::optional<uint32_t> crc_;  // running checksum of the payload being written
 
-#if defined(__linux__) || defined(__APPLE__)  // posix
-    struct stat st;
-    if (stat(full_path.c_str(), &st) != 0)
-      return false;
+  constexpr static size_t BUF_SIZE = 256 * 1024;
+  constexpr static size_t CDC_WINDOW = 4 << 20;
+  constexpr static uint64_t SCATTER_MIN = 1 << 20;  // smaller payloads are copied inline
+  constexpr static uint64_t PIECE = 16 << 20;       // bytes per scattered copy job
+  constexpr static uint64_t STAGE_MAX = 32 << 20;   // largest payload staged in memory
+  constexpr static uint64_t KEY_SEED = 0x9e3779b97f4a7c15ull;
 
-    unalign::write(&header.) h.mode = st.st_mode;
+  void write(const void* data, size_t size) {
+    output_.write(data, size);
+    offset_ += size;
+    if (crc_)
+      crc_ = crc::crc32c(*crc_, data, size);
+  }
+
+  // Writes the checksum of the payload just written, if one is being kept.
+  void seal() {
+    if (!crc_)
+      return;
+    checksum::repr buf;
+    sys::write_crc(&buf, *std::exchange(crc_, std::nullopt));
+    write(&buf, sizeof(buf));
+  }
+
+ public:
+  explicit bottle(io::sink& output, pack_options opts = {})
+      : output_(output), opts_(opts), stream_(opts.format), records_(opts.format) {
+    const auto& bar = magic(opts_.format);
+    write(bar.data(), bar.size());
+  }
+
+  // Continues an archive of `end` bytes in `opts.format`, the output must
+  // append there. Existing bytes are never touched, the new index goes after
+  // them.
+  bottle(io::sink& output, uint64_t end, pack_options opts = {})
+      : output_(output),
+        opts_(opts),
+        offset_(end),
+        stream_(opts.format),
+        records_(opts.format) {}
+
+  bottle(const bottle&) = delete;
+  auto operator=(const bottle&) -> bottle& = delete;
+
+  // Header for an entry described by `st`, nullopt for unsupported types.
+  static auto make_header(const struct stat& st) -> std::optional<header_t> {
+    header_t header{};
+    header.mode = st.st_mode;
     header.mtime = st.st_mtime;
 
     if (S_ISDIR(st.st_mode)) {
       header.type = entry_type::dir;
     } else if (S_ISREG(st.st_mode)) {
-      header.type = entry_type::regular_file;
+      header.type = entry_type::reg;
       header.data = st.st_size;
+    } else if (S_ISLNK(st.st_mode)) {
+      header.type = entry_type::sym;
+      header.data = st.st_size;  // length of the target
     } else {
-      return false;  // todo! impl symlinks
+      return std::nullopt;
     }
-#else
-    auto status = fs::symlink_status(full_path);
-    header.mode = static_cast<uint32_t>(status.permissions());
+    return header;
+  }
 
-    auto mtime = fs::last_write_time(full_path);
-    header.mtime =
-        chrono::duration_cast<chrono::seconds>(mtime.time_since_epoch()).count();
+  // Whether a stored header still describes a file. The stored size is only
+  // comparable for plain payloads, transformed ones rely on the mtime.
+  static auto unchanged(const header_t& stored, const struct stat& st) -> bool {
+    auto header = make_header(st);
+    if (!header || header->type != stored.type || header->mode != stored.mode ||
+        header->mtime != stored.mtime)
+      return false;
+    return (stored.flags & (flag::lz | flag::cdc | flag::sparse)) ||
+           header->data == stored.data;
+  }
 
-    if (fs::is_directory(status))
-      header.type = entry_type::dir;
-    else if (fs::is_regular_file(status)) {
-      header.type = entry_type::reg;
-      header.data = fs::file_size(full_path);
-    } else
-      return false;  // todo! impl symlinks
-#endif
+  // Whether the stored hard link `rec` of `archive` is still a name of the
+  // file `st`: the link itself has no size to compare, but it still points to
+  // the first name this run has seen for the same inode.
+  auto still_linked(int archive, const index::record& rec, const struct stat& st) const
+      -> bool {
+    const auto header = make_header(st);
+    if (rec.header.type != entry_type::link || !header || header->type != entry_type::reg ||
+        header->mode != rec.header.mode || header->mtime != rec.header.mtime)
+      return false;
+    const auto it = links_.find({st.st_dev, st.st_ino});
+    if (it == links_.end() || it->second.size() != rec.header.data)
+      return false;
+    std::string to(it->second.size(), '\0');
+    return sys::pread_all(archive, to.data(), to.size(), rec.offset) == to.size() &&
+           to == it->second;
+  }
 
-    header::repr buf;
-    sys::write_header(&buf, header);
+  // Writes an entry whose file is `name` relative to `dir_fd`.
+  auto write_entry(std::string_view path, const struct stat& st, int dir_fd,
+                   const char* name) -> bool {
+    if (path.size() > entry::MAX_NAME)
+      return skip(path, "path too long");
+
+    stats::timer timer(opts_.stats, stats::phase::payload);
+    auto header_opt = make_header(st);
+    if (!header_opt)
+      return false;
+    auto& header = *header_opt;
+    header.path = path.size();
+    raw_ = header.data;
+
+    std::string target;  // payload of a symlink or hard link
+    if (header.type == entry_type::sym) {
+      auto link = read_link(dir_fd, name);
+      if (!link)
+        return skip(path, "readlink", errno);
+      target = std::move(*link);
+    } else if (header.type == entry_type::reg && st.st_nlink > 1) {
+      if (const auto it = links_.find({st.st_dev, st.st_ino}); it != links_.end()) {
+        header.type = entry_type::link;
+        target = it->second;
+      }
+    }
+    if (opts_.checksum && header.type == entry_type::reg)
+      header.flags |= flag::crc;
 
-    output_.write(reinterpret_cast<const char*>(&buf), sizeof(buf));
-    output_.write(path_str.data(), header.path);
+    sys::fd in;
     if (header.type == entry_type::reg && header.data > 0) {
-      std::ifstream in(full_path, std::ios::binary);
-      output_ << in.rdbuf();
+      stats::timer open(opts_.stats, stats::phase::metadata);
+      in = sys::fd(::openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+      if (!in)
+        return skip(path, "open", errno);
     }
+
+    if (header.type == entry_type::sym || header.type == entry_type::link) {
+      write_link(header, path, target);
+    } else if (auto map = in ? data_extents(in.get(), st) : std::nullopt) {
+      write_sparse(header, path, in.get(), *map);
+    } else if (in && opts_.dedup && fits(header.data)) {
+      write_cdc(header, path, in.get());
+    } else if (in && opts_.compress && fits(header.data)) {
+      write_lz(header, path, in.get());
+    } else {
+      if (in && opts_.align && header.data >= ALIGN)
+        pad(header, path);
+      put_header(header, path);
+      if (in && scatters(header.data)) {
+        scatter(std::move(in), header.data, path);
+      } else if (in) {
+        copy(in.get(), header.data);
+      }
+    }
+    seal();
+    if (header.type == entry_type::reg)
+      remember(st, path);
+    if (opts_.stats)
+      opts_.stats->entry(offset_ - data_at_);
     return true;
   }
 
+  // Entries `write_entry` left out so far, special files aside.
+  auto skipped() const { return skipped_; }
+
+ private:
+  // Leaves out the entry at `path`, which failed with `what` or `err`, and
+  // reports it.
+  auto skip(std::string_view path, const char* what, int err = 0) -> bool {
+    skipped_++;
+    if (opts_.on_skip) {
+      auto why = std::string(what);
+      if (err)
+        why += ": " + std::generic_category().message(err);
+      opts_.on_skip(path, why);
+    }
+    return false;
+  }
+
+  // Writes a symlink or hard link entry, `target` being its payload.
+  void write_link(header_t header, std::string_view path, std::string_view target) {
+    header.data = target.size();
+    put_header(header, path);
+    write(target.data(), target.size());
+    seal();
+  }
+
+  // Target of the symlink `name` relative to `dir_fd`.
+  static auto read_link(int dir_fd, const char* name) -> std::optional<std::string> {
+    std::string target(PATH_MAX, '\0');
+    const auto n = ::readlinkat(dir_fd, name, target.data(), target.size());
+    if (n < 0)
+      return std::nullopt;
+    target.resize(static_cast<size_t>(n));
+    return target;
+  }
+
+  // Records the regular file `st` stored at `path`, if other names share it.
+  void remember(const struct stat& st, std::string_view path) {
+    if (st.st_nlink > 1)
+      links_.try_emplace({st.st_dev, st.st_ino}, path);
+  }
+
+  // Writes the header of an entry at `path` in the archive's format.
+  void write_head(const header_t& header, std::string_view path, bool wide = false) {
+    head_.clear();
+    stream_.put(head_, header, path, raw_, wide);
+    write(head_.data(), head_.size());
+  }
+
+  // Writes the header and path, and records the entry for the index. The
+  // payload checksum starts here.
+  void put_header(const header_t& header, std::string_view path, bool wide = false) {
+    stats::timer timer(opts_.stats, stats::phase::header);
+    write_head(header, path, wide);
+    data_at_ = offset_;
+
+    index::encode(records_, index_, header, offset_, path, raw_);
+    count_++;
+    if (header.flags & flag::crc)
+      crc_ = 0;
+  }
+
+  // Data extents of a file with holes, nullopt for a fully allocated one or
+  // where the filesystem can't tell.
+  static auto data_extents(int fd, const struct stat& st)
+      -> std::optional<std::vector<extent_t>> {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if (st.st_blocks * 512 >= st.st_size)
+      return std::nullopt;
+
+    std::vector<extent_t> map;
+    const auto size = static_cast<off_t>(st.st_size);
+    for (off_t at = 0; at < size;) {
+      const auto data = ::lseek(fd, at, SEEK_DATA);
+      if (data < 0 && errno == ENXIO)
+        break;  // only a hole is left
+      const auto hole = data < 0 ? -1 : ::lseek(fd, data, SEEK_HOLE);
+      if (hole < 0) {
+        ::lseek(fd, 0, SEEK_SET);
+        return std::nullopt;
+      }
+      const auto end = std::min(hole, size);
+      map.push_back({static_cast<uint64_t>(data), static_cast<uint64_t>(end - data)});
+      at = end;
+    }
+    ::lseek(fd, 0, SEEK_SET);
+
+    if (map.size() == 1 && map[0].offset == 0 && map[0].length == static_cast<uint64_t>(size))
+      return std::nullopt;
+    return map;
+#else
+    return std::nullopt;
+#endif
+  }
+
+  // Writes `fd` as a `flag::sparse` payload: the extent map, then only the
+  // bytes of `map`. Holes cost nothing on either side.
+  void write_sparse(header_t header, std::string_view path, int fd,
+                    const std::vector<extent_t>& map) {
+    const auto size = header.data;
+    header.flags |= flag::sparse;
+    header.data = sizeof(sparse::repr) + map.size() * sizeof(extent::repr);
+    for (const auto& ext : map) {
+      header.data += ext.length;
+    }
+    put_header(header, path);
+
+    sparse::repr head;
+    sys::write_sparse(&head, {size, map.size()});
+    write(&head, sizeof(head));
+    for (const auto& ext : map) {
+      extent::repr rec;
+      sys::write_extent(&rec, ext);
+      write(&rec, sizeof(rec));
+    }
+    for (const auto& ext : map) {
+      if (::lseek(fd, static_cast<off_t>(ext.offset), SEEK_SET) < 0)
+        sys::fail("lseek", path);
+      copy(fd, ext.length);
+    }
+  }
+
+  // Writes a filler entry so that the payload of `next` at `path` starts on
+  // an `ALIGN` boundary of the archive. The filler's size is wide, so its
+  // header doesn't shrink or grow with it.
+  void pad(const header_t& next, std::string_view path) {
+    auto gap = (ALIGN - (offset_ + stream_.size(next, path, raw_)) % ALIGN) % ALIGN;
+    if (gap == 0)
+      return;
+
+    header_t header{};
+    header.type = entry_type::pad;
+    const auto head = stream_.size(header, {}, 0, true);
+    if (gap < head)
+      gap += ALIGN;
+    header.data = gap - head;
+
+    write_head(header, {}, true);
+    static const std::vector<char> zeros(ALIGN);
+    write(zeros.data(), header.data);
+  }
+
+  // Reads `size` bytes at `offset`, zero-filled past the end like `copy`.
+  static void read_block(int fd, char* data, size_t size, uint64_t offset) {
+    const auto n = sys::pread_all(fd, data, size, offset);
+    std::fill(data + n, data + size, 0);
+  }
+
+  // Writes `fd` as a `flag::lz` payload. A single block is compressed inline
+  // and stored plainly if that doesn't pay off; bigger files go through the
+  // pool and the header is patched once the size is known.
+  void write_lz(header_t header, std::string_view path, int fd) {
+    const auto size = header.data;
+
+    if (size <= block::SIZE) {
+      thread_local std::vector<char> raw, packed;
+      raw.resize(size);
+      packed.resize(sizeof(block::repr) + lz::bound(size));
+      read_block(fd, raw.data(), size, 0);
+
+      const auto n = lz::compress(raw.data(), size, packed.data() + sizeof(block::repr));
+      if (sizeof(block::repr) + n >= size) {
+        put_header(header, path);
+        write(raw.data(), size);
+        return;
+      }
+
+      block::repr frame;
+      sys::write_block(&frame, {static_cast<uint32_t>(size), static_cast<uint32_t>(n)});
+      std::memcpy(packed.data(), &frame, sizeof(frame));
+
+      header.flags |= flag::lz;
+      header.data = sizeof(frame) + n;
+      put_header(header, path);
+      write(packed.data(), header.data);
+      return;
+    }
+
+    header.flags |= flag::lz;
+    write_sized(header, path, [&](uint64_t, auto&& emit) { compress(fd, size, emit); });
+  }
+
+  // Writes `fd` as a `flag::cdc` payload: chunks already stored in this
+  // archive become references to their first copy.
+  void write_cdc(header_t header, std::string_view path, int fd) {
+    const auto size = header.data;
+    header.flags |= flag::cdc;
+
+    write_sized(header, path, [&](uint64_t at, auto&& emit) {
+      thread_local std::vector<char> buf(CDC_WINDOW);
+      size_t pos = 0, have = 0;
+      uint64_t read_at = 0;
+
+      while (true) {
+        // keep a whole max chunk ahead so cut points don't depend on reads
+        if (have - pos < cdc::MAX_SIZE && read_at < size) {
+          std::memmove(buf.data(), buf.data() + pos, have - pos);
+          have -= pos;
+          pos = 0;
+          const auto n = std::min<uint64_t>(buf.size() - have, size - read_at);
+          read_block(fd, buf.data() + have, n, read_at);
+          read_at += n;
+          have += n;
+        }
+        if (pos == have)
+          break;
+
+        const auto* data = buf.data() + pos;
+        const auto len = cdc::cut(reinterpret_cast<const uint8_t*>(data), have - pos);
+        put_chunk(data, len, at, emit);
+        pos += len;
+      }
+    });
+  }
+
+  // Emits the record of a chunk whose record goes at `at`, followed by its
+  // bytes the first time they are seen, and moves `at` past them.
+  template <typename F>
+  void put_chunk(const char* data, size_t len, uint64_t& at, F&& emit) {
+    const chunk_key key{hash::xxh64(data, len), hash::xxh64(data, len, KEY_SEED),
+                        static_cast<uint32_t>(len)};
+
+    chunk::repr rec;
+    auto [it, fresh] = chunks_.try_emplace(key, at + sizeof(rec));
+    sys::write_chunk(&rec, {fresh ? 0 : it->second, key.size});
+    emit(reinterpret_cast<const char*>(&rec), sizeof(rec));
+    at += sizeof(rec);
+    if (fresh) {
+      emit(data, len);
+      at += len;
+    }
+  }
+
+  // Copies an entry of another archive, `archive`, whose payload is at
+  // `offset`. Payloads are self-contained and copied as they are, with their
+  // checksum, except chunk lists: their references are offsets in the other
+  // archive, so they are stored again chunk by chunk.
+  void copy_entry(int archive, header_t header, std::string_view path, uint64_t offset) {
+    header.path = static_cast<uint16_t>(path.size());
+    if (header.flags & flag::cdc) {
+      copy_cdc(archive, header, path, offset);
+      seal();
+      return;
+    }
+    raw_ = sys::raw_size(header, offset, [&](void* data, size_t size, uint64_t at) {
+      return sys::pread_all(archive, data, size, at);
+    });
+    const bool plain = header.type == entry_type::reg && !(header.flags & flag::lz) &&
+                       !(header.flags & flag::sparse);
+    if (plain && opts_.align && header.data >= ALIGN)
+      pad(header, path);
+    put_header(header, path);
+    crc_.reset();  // the stored one comes along
+    const auto crc = header.flags & flag::crc ? sizeof(checksum::repr) : 0;
+    copy_from(archive, offset, header.data + crc);
+  }
+
+  // Stores the chunks of the `flag::cdc` payload of `archive` at `offset`
+  // again, as `write_cdc` would have stored the same cut points.
+  void copy_cdc(int archive, header_t header, std::string_view path, uint64_t offset) {
+    const auto stored = header.data;
+    uint64_t size = 0;
+    each_chunk(archive, offset, stored, [&](const char*, size_t len) { size += len; });
+    raw_ = size;
+    if (!fits(size)) {
+      // too big to stage for an unseekable sink, the chunks are joined
+      header.flags &= ~flag::cdc;
+      header.data = size;
+      put_header(header, path);
+      each_chunk(archive, offset, stored, [&](const char* data, size_t len) {
+        write(data, len);
+      }, true);
+      return;
+    }
+    write_sized(header, path, [&](uint64_t at, auto&& emit) {
+      each_chunk(archive, offset, header.data, [&](const char* data, size_t len) {
+        put_chunk(data, len, at, emit);
+      }, true);
+    });
+  }
+
+  // Passes the chunks of the `flag::cdc` payload of `size` bytes at `offset`
+  // of `archive` to `fn(data, len)` in order, references resolved. Without
+  // `read` only the lengths are valid.
+  template <typename F>
+  static void each_chunk(int archive, uint64_t offset, uint64_t size, F&& fn,
+                         bool read = false) {
+    thread_local std::vector<char> buf(cdc::MAX_SIZE);
+    const auto end = offset + size;
+    while (end - offset >= sizeof(chunk::repr)) {
+      chunk::repr rec;
+      if (sys::pread_all(archive, &rec, sizeof(rec), offset) != sizeof(rec))
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      const auto chunk = sys::read_chunk(&rec);
+      offset += sizeof(rec);
+
+      auto from = chunk.ref;
+      if (chunk.ref == 0) {
+        if (chunk.size > end - offset)
+          throw std::runtime_error("corrupt bar archive: bad chunk");
+        from = offset;
+        offset += chunk.size;
+      }
+      if (chunk.size > buf.size() ||
+          (read && sys::pread_all(archive, buf.data(), chunk.size, from) != chunk.size))
+        throw std::runtime_error("corrupt bar archive: bad chunk reference");
+      fn(buf.data(), chunk.size);
+    }
+  }
+
+  // Whether a payload of `size` bytes can be stored in a form whose size is
+  // only known at the end. An unseekable sink stages it whole first, so big
+  // ones are stored plainly there to keep memory bounded.
+  bool fits(uint64_t size) const { return output_.seekable() || size <= STAGE_MAX; }
+
+  // Appends `size` bytes of `fd` at `offset`, inside the kernel where the
+  // sink allows it.
+  void copy_from(int fd, uint64_t offset, uint64_t size) {
+    auto at = static_cast<off_t>(offset);
+    const auto sent = output_.receive(fd, &at, size);
+    offset_ += sent;
+    offset += sent;
+    size -= sent;
+
+    thread_local std::vector<char> buf(BUF_SIZE);
+    while (size > 0) {
+      const auto n = sys::pread_all(fd, buf.data(), std::min<uint64_t>(size, buf.size()), offset);
+      if (n == 0)
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      write(buf.data(), n);
+      offset += n;
+      size -= n;
+    }
+  }
+
+  // Writes an entry whose payload size is only known once `produce(data_at,
+  // emit)` has run, so the size is wide. Small payloads and those of
+  // unseekable sinks, at most `STAGE_MAX` there, are staged in memory; bigger
+  // ones are streamed and the header is patched in place afterwards.
+  template <typename F>
+  void write_sized(header_t header, std::string_view path, F&& produce) {
+    std::optional<stats::timer> timer;
+    const auto at = offset_;
+    if (header.data <= block::SIZE || !output_.seekable()) {
+      stage_.clear();
+      const auto data_at = offset_ + stream_.size(header, path, raw_, true);
+      produce(data_at, [&](const char* data, size_t n) {
+        stage_.insert(stage_.end(), data, data + n);
+      });
+      header.data = stage_.size();
+      put_header(header, path, true);
+      write(stage_.data(), stage_.size());
+      return;
+    }
+
+    timer.emplace(opts_.stats, stats::phase::header);
+    auto before = stream_;  // to encode the header again once the size is known
+    write_head(header, path, true);
+    if (header.flags & flag::crc)
+      crc_ = 0;
+    timer.reset();
+
+    const auto data_at = data_at_ = offset_;
+    produce(data_at, [&](const char* data, size_t n) { write(data, n); });
+    header.data = offset_ - data_at;
+
+    timer.emplace(opts_.stats, stats::phase::header);
+    head_.clear();
+    before.put(head_, header, path, raw_, true);
+    output_.patch(at, head_.data(), head_.size());
+
+    index::encode(records_, index_, header, data_at, path, raw_);
+    count_++;
+  }
+
+  // Splits `size` bytes of `fd` into blocks compressed on the pool and passes
+  // the framed blocks to `emit` in order. Only a small window of blocks is in
+  // flight, so memory stays bounded for any file size.
+  template <typename F>
+  void compress(int fd, uint64_t size, F&& emit) {
+    if (!pool_)
+      pool_ = std::make_unique<pool>(opts_.jobs);
+
+    struct job {
+      std::vector<char> raw, packed;
+      size_t size = 0;
+      std::future<void> done;
+    };
+    std::deque<std::shared_ptr<job>> window;
+
+    auto flush = [&] {
+      auto job = std::move(window.front());
+      window.pop_front();
+      job->done.get();
+
+      const bool stored = job->size >= job->raw.size();
+      const auto& data = stored ? job->raw : job->packed;
+      const auto n = stored ? job->raw.size() : job->size;
+
+      block::repr frame;
+      sys::write_block(&frame, {static_cast<uint32_t>(job->raw.size()),
+                                static_cast<uint32_t>(n)});
+      emit(reinterpret_cast<const char*>(&frame), sizeof(frame));
+      emit(data.data(), n);
+    };
+
+    for (uint64_t off = 0; off < size; off += block::SIZE) {
+      auto job = std::make_shared<struct job>();
+      job->raw.resize(std::min<uint64_t>(block::SIZE, size - off));
+      read_block(fd, job->raw.data(), job->raw.size(), off);
+
+      auto task = std::make_shared<std::packaged_task<void()>>([job] {
+        job->packed.resize(lz::bound(job->raw.size()));
+        job->size = lz::compress(job->raw.data(), job->raw.size(), job->packed.data());
+      });
+      job->done = task->get_future();
+      pool_->submit([task] { (*task)(); });
+
+      window.push_back(std::move(job));
+      if (window.size() >= 2 * pool_->size())
+        flush();
+    }
+    while (!window.empty()) {
+      flush();
+    }
+  }
+
+  // Whether a plain payload of `size` bytes is left to `scatter`: its offset
+  // is known up front, so it can be written out of order.
+  bool scatters(uint64_t size) const {
+    return opts_.jobs > 1 && size >= SCATTER_MIN && output_.seekable() && output_.fd() >= 0;
+  }
+
+  // Reserves the `size` bytes of `fd`, and their checksum if one is kept, in
+  // the sink and leaves them to the pool: jobs copy pieces of the file to
+  // their final offsets, so several files are read and written at once. The
+  // archive is byte for byte what `copy` writes.
+  void scatter(sys::fd fd, uint64_t size, std::string_view path) {
+    if (!pool_)
+      pool_ = std::make_unique<pool>(opts_.jobs);
+
+    const bool sum = std::exchange(crc_, std::nullopt).has_value();
+    const auto at = offset_;
+    const auto stored = size + (sum ? sizeof(checksum::repr) : 0);
+    output_.reserve(stored);
+    offset_ += stored;
+
+    const auto in = std::make_shared<const sys::fd>(std::move(fd));
+    const auto out = output_.fd();
+    // the checksum needs the bytes in order, a single job copies them then
+    const auto piece = sum ? size : PIECE;
+    for (uint64_t off = 0; off < size; off += piece) {
+      pool_->submit([=, path = fs::path(path)] {
+        const auto n = std::min(piece, size - off);
+        const auto crc = copy_at(in->get(), off, out, at + off, n, sum, path);
+        if (!sum)
+          return;
+        checksum::repr buf;
+        sys::write_crc(&buf, crc);
+        if (!sys::pwrite_all(out, &buf, sizeof(buf), at + size))
+          sys::fail("pwrite", path);
+      });
+    }
+  }
+
+  // Copies `size` bytes of `in` at `in_at` to `out` at `out_at`, zero-filled
+  // past the end of `in` like `copy`. With `sum` the bytes pass through
+  // userspace and their crc32c is returned.
+  static auto copy_at(int in, uint64_t in_at, int out, uint64_t out_at, uint64_t size,
+                      bool sum, const fs::path& path) -> uint32_t {
+    uint64_t done = sum ? 0 : sys::copy_range(in, in_at, out, out_at, size);
+    uint32_t crc = 0;
+    thread_local std::vector<char> buf(BUF_SIZE);
+    while (done < size) {
+      const auto n = std::min<uint64_t>(size - done, buf.size());
+      read_block(in, buf.data(), n, in_at + done);
+      if (sum)
+        crc = crc::crc32c(crc, buf.data(), n);
+      if (!sys::pwrite_all(out, buf.data(), n, out_at + done))
+        sys::fail("pwrite", path);
+      done += n;
+    }
+    return crc;
+  }
+
+  // Copies `size` bytes of `fd` into the archive, zero-filling if the file
+  // shrank meanwhile so the header stays truthful. Stays in the kernel when
+  // the sink has a descriptor and no checksum has to see the bytes.
+  void copy(int fd, uint64_t size) {
+    if (!crc_) {
+      const auto n = output_.receive(fd, nullptr, size);
+      offset_ += n;
+      size -= n;
+    }
+
+    thread_local std::vector<char> buf(BUF_SIZE);
+    while (size > 0) {
+      auto n = ::read(fd, buf.data(), std::min<uint64_t>(size, buf.size()));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        std::ranges::fill(buf, 0);
+        n = static_cast<ssize_t>(std::min<uint64_t>(size, buf.size()));
+      }
+      write(buf.data(), n);
+      size -= n;
+    }
+  }
+
  public:
+  auto write_file(const fs::path& full_path, const fs::path& rel_path) -> bool {
+    struct stat st;
+    if (::stat(full_path.c_str(), &st) != 0)
+      return false;
+    return write_entry(rel_path.generic_string(), st, AT_FDCWD, full_path.c_str());
+  }
+
+  // Adds `path` and, for a directory, everything below it. Named relative to
+  // the parent of `path`, even for `.` or a trailing slash.
   void append(const fs::path& path) {
-    const auto base = path.parent_path();
+    // whatever `write_entry` doesn't claim is waiting for the walker
+    stats::timer timer(opts_.stats, stats::phase::walk);
+    walker walk(path, opts_.jobs);
+    walk.walk([&](const std::string& rel, int dir_fd, const char* name,
+                  const struct stat& st) { write_entry(rel, st, dir_fd, name); });
+  }
+
+  // Appends what changed in `inputs` since `previous`, the index of
+  // `archive`, the archive being continued. Entries whose type, mode, mtime
+  // and size still match are only carried over to the new index; entries
+  // that vanished from under an input get a tombstone. Entries of other
+  // inputs are kept.
+  void update(const std::vector<fs::path>& inputs, const bar::index& previous, int archive) {
+    const auto& records = previous.records();
+    std::vector<bool> seen(records.size());
+    std::vector<std::string> roots;
+
+    stats::timer timer(opts_.stats, stats::phase::walk);
+    for (const auto& input : inputs) {
+      walker walk(input, opts_.jobs);
+      roots.push_back(walk.root());
+      walk.walk([&](const std::string& rel, int dir_fd, const char* name,
+                    const struct stat& st) {
+        if (const auto* rec = previous.find(rel)) {
+          seen[rec - records.data()] = true;
+          if (unchanged(rec->header, st) || still_linked(archive, *rec, st)) {
+            keep(*rec);
+            if (rec->header.type == entry_type::reg)
+              remember(st, rel);
+            return;
+          }
+          // a sequential reader empties the directory before replacing it
+          if (rec->header.type == entry_type::dir && !S_ISDIR(st.st_mode))
+            tombstone(rel);
+        }
+        write_entry(rel, st, dir_fd, name);
+      });
+    }
 
-    if (fs::is_directory(path)) {
-      write_file(path, fs::relative(path, base));
-      for (const auto& entry : fs::recursive_directory_iterator(path)) {
-        write_file(entry.path(), fs::relative(entry.path(), base));
+    auto under = [&](std::string_view path) {
+      return std::ranges::any_of(roots, [&](std::string_view root) {
+        return path.starts_with(root) && (path.size() == root.size() || path[root.size()] == '/');
+      });
+    };
+    for (size_t i = 0; i < records.size(); ++i) {
+      const auto& rec = records[i];
+      if (seen[i] || !previous.is_live(rec))
+        continue;
+      if (under(rec.path)) {
+        tombstone(rec.path);
+      } else {
+        keep(rec);
+      }
+    }
+  }
+
+  // An archive being merged: a descriptor its payloads are read from with
+  // `pread`, and its index.
+  struct source {
+    int fd;
+    const bar::index& index;
+  };
+
+  // Copies the live entries of `sources` that `exclude` doesn't match,
+  // without unpacking them. A path in several archives comes from the last
+  // one, in the place it has there. A hard link whose first name doesn't
+  // come along from the same archive gets the contents of that name, and
+  // the later links to it point to the copy.
+  void merge(std::span<const source> sources, const bar::glob& exclude) {
+    // the record every merged path is taken from
+    std::unordered_map<std::string_view, const index::record*> latest;
+    for (const auto& src : sources) {
+      for (const auto& rec : src.index.records()) {
+        if (src.index.is_live(rec) && (exclude.empty() || !exclude.matches(rec.path)))
+          latest.insert_or_assign(rec.path, &rec);
+      }
+    }
+
+    for (const auto& src : sources) {
+      // first names of hard links that became copies, and the copies' paths
+      std::unordered_map<std::string_view, std::string_view> moved;
+      for (const auto& rec : src.index.records()) {
+        const auto it = latest.find(rec.path);
+        if (it == latest.end() || it->second != &rec)
+          continue;
+
+        stats::timer timer(opts_.stats, stats::phase::payload);
+        if (rec.header.type != entry_type::link) {
+          copy_entry(src.fd, rec.header, rec.path, rec.offset);
+        } else {
+          relink(src, rec, latest, moved);
+        }
+        if (opts_.stats)
+          opts_.stats->entry(offset_ - data_at_);
       }
-    } else {
-      write_file(path, path.filename());
     }
   }
+
+ private:
+  // Copies the hard link `rec` of `src` for `merge`.
+  void relink(const source& src, const index::record& rec,
+              const std::unordered_map<std::string_view, const index::record*>& latest,
+              std::unordered_map<std::string_view, std::string_view>& moved) {
+    std::string first(std::min<uint64_t>(rec.header.data, entry::MAX_NAME), '\0');
+    if (rec.header.data > entry::MAX_NAME ||
+        sys::pread_all(src.fd, first.data(), first.size(), rec.offset) != first.size())
+      throw std::runtime_error("corrupt bar archive: bad link in '" + std::string(rec.path) +
+                               "'");
+
+    if (const auto it = moved.find(first); it != moved.end()) {
+      write_link(rec.header, rec.path, it->second);
+      return;
+    }
+    const auto* orig = src.index.find(first);
+    const auto kept = latest.find(first);
+    if (!orig || orig->header.type != entry_type::reg ||
+        (kept != latest.end() && kept->second == orig && orig < &rec)) {
+      copy_entry(src.fd, rec.header, rec.path, rec.offset);  // as it is
+      return;
+    }
+    copy_entry(src.fd, orig->header, rec.path, orig->offset);
+    moved.emplace(orig->path, rec.path);
+  }
+
+ public:
+  // Lists an entry already stored in the archive in the new index.
+  void keep(const bar::index::record& rec) {
+    index::encode(records_, index_, rec.header, rec.offset, rec.path, rec.raw);
+    count_++;
+  }
+
+  // Marks `path` as removed for sequential readers, it is left out of the index.
+  void tombstone(std::string_view path) {
+    header_t header{};
+    header.type = entry_type::del;
+    write_head(header, path);
+  }
+
+  // Writes the central index and the trailer pointing to it, nothing can be
+  // appended afterwards. Never called on destruction: an archive whose
+  // writing failed halfway must not look complete.
+  void finish() {
+    if (std::exchange(finished_, true))
+      return;
+    if (pool_)
+      pool_->wait();  // scattered payloads, and their errors
+    stats::timer timer(opts_.stats, stats::phase::header);
+
+    header_t header{};
+    header.type = entry_type::index;
+    header.data = index_.size() + sizeof(trailer::repr);
+
+    trailer_t trailer{};
+    trailer.index = offset_;
+    trailer.count = count_;
+    trailer.magic = magic(opts_.format);
+
+    write_head(header, {});
+    write(index_.data(), index_.size());
+
+    trailer::repr tail;
+    sys::write_trailer(&tail, trailer);
+    write(&tail, sizeof(tail));
+
+    output_.flush();
+  }
 };
 
 }  // namespace bar
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// FastCDC content-defined chunking: a gear rolling hash picks cut points
+// from the content itself, so an insertion only moves the chunks around it.
+// Normalized chunking uses a stricter mask before the average size and a
+// looser one after it, keeping chunk sizes close to the average.
+namespace bar::cdc {
+
+constexpr size_t MIN_SIZE = 2 * 1024;
+constexpr size_t AVG_SIZE = 8 * 1024;
+constexpr size_t MAX_SIZE = 64 * 1024;
+
+// spread masks for an 8 KiB average, from the FastCDC paper
+constexpr uint64_t MASK_S = 0x0003590703530000ull;
+constexpr uint64_t MASK_L = 0x0000d90003530000ull;
+
+namespace detail {
+
+constexpr auto gear() -> std::array<uint64_t, 256> {
+  std::array<uint64_t, 256> table{};
+  uint64_t state = 0x62617220;  // fixed, archives must not depend on the build
+  for (auto& val : table) {
+    // splitmix64
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    val = z ^ (z >> 31);
+  }
+  return table;
+}
+
+constexpr auto GEAR = gear();
+
+}  // namespace detail
+
+// Length of the first chunk of `data`; `size` shorter than `MAX_SIZE` is
+// taken as the end of the input.
+inline auto cut(const uint8_t* data, size_t size) -> size_t {
+  using detail::GEAR;
+
+  if (size <= MIN_SIZE)
+    return size;
+  if (size > MAX_SIZE)
+    size = MAX_SIZE;
+  const auto normal = size < AVG_SIZE ? size : AVG_SIZE;
+
+  uint64_t hash = 0;
+  size_t at = MIN_SIZE;
+  for (; at < normal; at++) {
+    hash = (hash << 1) + GEAR[data[at]];
+    if (!(hash & MASK_S))
+      return at;
+  }
+  for (; at < size; at++) {
+    hash = (hash << 1) + GEAR[data[at]];
+    if (!(hash & MASK_L))
+      return at;
+  }
+  return size;
+}
+
+}  // namespace bar::cdc
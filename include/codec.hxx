@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "entry.hxx"
+#include "header.hxx"
+#include "sys.hxx"
+
+namespace bar {
+
+// LEB128: seven bits per byte, least significant first, the high bit set on
+// every byte but the last.
+namespace varint {
+
+constexpr size_t MAX = 10;  // bytes of the largest 64-bit value
+
+constexpr auto size(uint64_t val) -> size_t {
+  size_t n = 1;
+  for (; val >= 0x80; val >>= 7) {
+    n++;
+  }
+  return n;
+}
+
+// Appends `val`, padded with continuation bytes to `width` bytes if it is
+// shorter, so a bigger value can overwrite it in place later.
+inline void put(std::vector<char>& out, uint64_t val, size_t width = 0) {
+  for (size_t n = 1; val >= 0x80 || n < width; ++n) {
+    out.push_back(static_cast<char>((val & 0x7f) | 0x80));
+    val >>= 7;
+  }
+  out.push_back(static_cast<char>(val));
+}
+
+// Decodes a varint from `next()`, which yields the following byte or nullopt
+// at the end. nullopt when truncated or longer than `MAX` bytes.
+template <typename F>
+constexpr auto get(F&& next) -> std::optional<uint64_t> {
+  uint64_t val = 0;
+  for (size_t i = 0; i < MAX; ++i) {
+    const std::optional<uint8_t> byte = next();
+    if (!byte)
+      return std::nullopt;
+    val |= static_cast<uint64_t>(*byte & 0x7f) << (7 * i);
+    if (!(*byte & 0x80))
+      return val;
+  }
+  return std::nullopt;
+}
+
+// Maps signed values to unsigned ones, small magnitudes to small varints:
+// 0, -1, 1, -2, 2...
+constexpr auto zigzag(int64_t val) -> uint64_t {
+  return (static_cast<uint64_t>(val) << 1) ^ static_cast<uint64_t>(val >> 63);
+}
+
+constexpr auto unzigzag(uint64_t val) -> int64_t {
+  return static_cast<int64_t>((val >> 1) ^ (0 - (val & 1)));
+}
+
+static_assert(unzigzag(zigzag(-1)) == -1 && zigzag(-1) == 1 && zigzag(1) == 2);
+static_assert(unzigzag(zigzag(std::numeric_limits<int64_t>::min())) ==
+              std::numeric_limits<int64_t>::min());
+
+}  // namespace varint
+
+// Entry headers and their paths in the layout of one `format`. v1 is a
+// `header::repr` followed by the path. v2 is
+//
+//   type | flags | mtime | mode | data | [raw] | shared | suffix size | suffix
+//
+// with varints after the first two bytes, `mtime` zigzagged. `raw` is the
+// size of the file, only there when the payload transforms it (`data` is
+// what is stored); v1 has no room for it. The path is the
+// first `shared` bytes of the previous path followed by the suffix, so the
+// common prefixes of a tree cost a byte or two per entry. Filler and index
+// entries have no path fields and don't count as the previous path; an index
+// entry starts over from an empty one, so the entries `bar a -u` appends
+// after it decode on their own.
+//
+// A codec carries the previous path: it must see every header of one stream
+// or index, in order.
+class codec {
+  bar::format format_;
+  std::string prev_;
+  size_t path_size_ = 0;  // of the header decoded last
+  uint64_t raw_ = 0;      // likewise
+
+  static bool has_path(entry_type type) {
+    return type != entry_type::pad && type != entry_type::index;
+  }
+
+  static bool has_raw(const header_t& header) {
+    return header.flags & (flag::lz | flag::cdc | flag::sparse);
+  }
+
+  auto shared(std::string_view path) const -> size_t {
+    const auto n = std::min(path.size(), prev_.size());
+    return std::mismatch(path.begin(), path.begin() + n, prev_.begin()).first - path.begin();
+  }
+
+ public:
+  explicit codec(bar::format format) : format_(format) {}
+
+  auto format() const -> bar::format { return format_; }
+
+  // Smallest encoded header, for bounds checks.
+  auto min_size() const -> size_t {
+    return format_ == format::v1 ? sizeof(header::repr) : 5;
+  }
+
+  // Bytes `put` appends for `header` at `path`.
+  auto size(const header_t& header, std::string_view path, uint64_t raw,
+            bool wide = false) const -> size_t {
+    if (format_ == format::v1)
+      return sizeof(header::repr) + path.size();
+
+    auto n = 2 + varint::size(varint::zigzag(header.mtime)) + varint::size(header.mode) +
+             (wide ? varint::MAX : varint::size(header.data)) +
+             (has_raw(header) ? varint::size(raw) : 0);
+    if (has_path(header.type)) {
+      const auto same = shared(path);
+      n += varint::size(same) + varint::size(path.size() - same) + path.size() - same;
+    }
+    return n;
+  }
+
+  // Appends the header of an entry at `path` whose file has `raw` bytes. With
+  // `wide`, the data size takes a fixed width, so a copy of the codec made
+  // before the call can encode the header again over the old one once the
+  // size is known.
+  void put(std::vector<char>& out, header_t header, std::string_view path, uint64_t raw,
+           bool wide = false) {
+    header.path = static_cast<uint16_t>(path.size());
+    if (format_ == format::v1) {
+      header::repr buf;
+      sys::write_header(&buf, header);
+      out.insert(out.end(), buf.begin(), buf.end());
+      out.insert(out.end(), path.begin(), path.end());
+      return;
+    }
+
+    out.push_back(static_cast<char>(header.type));
+    out.push_back(static_cast<char>(header.flags));
+    varint::put(out, varint::zigzag(header.mtime));
+    varint::put(out, header.mode);
+    varint::put(out, header.data, wide ? varint::MAX : 0);
+    if (has_raw(header))
+      varint::put(out, raw);
+    if (header.type == entry_type::index)
+      prev_.clear();
+    if (!has_path(header.type))
+      return;
+
+    const auto same = shared(path);
+    varint::put(out, same);
+    varint::put(out, path.size() - same);
+    out.insert(out.end(), path.begin() + same, path.end());
+    prev_.assign(path);
+  }
+
+  // Decodes the next header with `read(data, size)`, which reads exactly
+  // `size` bytes or returns false. nullopt when the bytes end first or make
+  // no sense. The path is `path()` until the next call.
+  template <typename F>
+  auto get(F&& read) -> std::optional<header_t> {
+    path_size_ = 0;
+    if (format_ == format::v1) {
+      header::repr buf;
+      if (!read(&buf, sizeof(buf)))
+        return std::nullopt;
+      const auto header = sys::read_header(&buf);
+      prev_.resize(header.path);
+      if (!read(prev_.data(), prev_.size()))
+        return std::nullopt;
+      path_size_ = header.path;
+      raw_ = header.data;
+      return header;
+    }
+
+    auto next = [&]() -> std::optional<uint8_t> {
+      uint8_t byte;
+      if (!read(&byte, 1))
+        return std::nullopt;
+      return byte;
+    };
+    uint8_t fixed[2];
+    if (!read(fixed, sizeof(fixed)))
+      return std::nullopt;
+    const auto mtime = varint::get(next);
+    const auto mode = varint::get(next);
+    const auto data = varint::get(next);
+    if (!mtime || !mode || !data || *mode > std::numeric_limits<uint32_t>::max())
+      return std::nullopt;
+
+    header_t header{};
+    header.type = static_cast<entry_type>(fixed[0]);
+    header.flags = fixed[1];
+    header.mtime = varint::unzigzag(*mtime);
+    header.mode = static_cast<uint32_t>(*mode);
+    header.data = *data;
+    raw_ = header.data;
+    if (has_raw(header)) {
+      const auto raw = varint::get(next);
+      if (!raw)
+        return std::nullopt;
+      raw_ = *raw;
+    }
+    if (header.type == entry_type::index)
+      prev_.clear();
+    if (!has_path(header.type))
+      return header;
+
+    const auto same = varint::get(next);
+    const auto rest = varint::get(next);
+    if (!same || !rest || *same > prev_.size() || *rest > entry::MAX_NAME - *same)
+      return std::nullopt;
+    prev_.resize(*same + *rest);
+    if (!read(prev_.data() + *same, *rest))
+      return std::nullopt;
+    header.path = static_cast<uint16_t>(prev_.size());
+    path_size_ = prev_.size();
+    return header;
+  }
+
+  // Path of the header `get` returned last.
+  auto path() const -> std::string_view { return {prev_.data(), path_size_}; }
+
+  // File size of the header `get` returned last. Only the stored size of a
+  // transformed payload in v1, see `sys::raw_size`.
+  auto raw() const -> uint64_t { return raw_; }
+};
+
+}  // namespace bar
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// CRC32C (Castagnoli). Uses the SSE4.2 `crc32` instruction when the CPU has
+// it, chosen once at runtime, or the ARMv8 CRC extension when built for it;
+// otherwise slicing-by-8 tables. `crc32c(crc32c(0, a), b) == crc32c(0, ab)`.
+namespace bar::crc {
+
+namespace detail {
+
+constexpr uint32_t POLY = 0x82f63b78;  // reflected
+
+constexpr auto tables() -> std::array<std::array<uint32_t, 256>, 8> {
+  std::array<std::array<uint32_t, 256>, 8> table{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (POLY & (0u - (crc & 1)));
+    }
+    table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; ++i) {
+    for (size_t k = 1; k < 8; ++k) {
+      table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+    }
+  }
+  return table;
+}
+
+constexpr auto TABLES = tables();
+
+inline auto soft(uint32_t crc, const uint8_t* at, size_t size) -> uint32_t {
+  for (; size >= 8; size -= 8, at += 8) {
+    uint32_t lo, hi;
+    std::memcpy(&lo, at, 4);
+    std::memcpy(&hi, at + 4, 4);
+    if constexpr (std::endian::native == std::endian::big) {
+      lo = __builtin_bswap32(lo);
+      hi = __builtin_bswap32(hi);
+    }
+    lo ^= crc;
+    crc = TABLES[7][lo & 0xff] ^ TABLES[6][(lo >> 8) & 0xff] ^ TABLES[5][(lo >> 16) & 0xff] ^
+          TABLES[4][lo >> 24] ^ TABLES[3][hi & 0xff] ^ TABLES[2][(hi >> 8) & 0xff] ^
+          TABLES[1][(hi >> 16) & 0xff] ^ TABLES[0][hi >> 24];
+  }
+  for (; size > 0; size--, at++) {
+    crc = (crc >> 8) ^ TABLES[0][(crc ^ *at) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline auto hard(uint32_t crc, const uint8_t* at,
+                                                   size_t size) -> uint32_t {
+  uint64_t acc = crc;
+  for (; size >= 8; size -= 8, at += 8) {
+    uint64_t val;
+    std::memcpy(&val, at, sizeof(val));
+    acc = _mm_crc32_u64(acc, val);
+  }
+  auto crc32 = static_cast<uint32_t>(acc);
+  for (; size > 0; size--, at++) {
+    crc32 = _mm_crc32_u8(crc32, *at);
+  }
+  return crc32;
+}
+
+inline const bool HAS_SSE42 = __builtin_cpu_supports("sse4.2");
+#elif defined(__ARM_FEATURE_CRC32)
+inline auto hard(uint32_t crc, const uint8_t* at, size_t size) -> uint32_t {
+  for (; size >= 8; size -= 8, at += 8) {
+    uint64_t val;
+    std::memcpy(&val, at, sizeof(val));
+    crc = __crc32cd(crc, val);
+  }
+  for (; size > 0; size--, at++) {
+    crc = __crc32cb(crc, *at);
+  }
+  return crc;
+}
+#endif
+
+}  // namespace detail
+
+inline auto crc32c(uint32_t crc, const void* data, size_t size) -> uint32_t {
+  const auto* at = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+#if defined(__x86_64__)
+  crc = detail::HAS_SSE42 ? detail::hard(crc, at, size) : detail::soft(crc, at, size);
+#elif defined(__ARM_FEATURE_CRC32)
+  crc = detail::hard(crc, at, size);
+#else
+  crc = detail::soft(crc, at, size);
+#endif
+  return ~crc;
+}
+
+namespace detail {
+
+// `a * b` modulo the polynomial, bit-reflected like the checksum.
+constexpr auto multiply(uint32_t a, uint32_t b) -> uint32_t {
+  uint32_t product = 0;
+  for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+    if (a & m)
+      product ^= b;
+    b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+  }
+  return product;
+}
+
+// x^(2^n) modulo the polynomial, for every bit n of a 64-bit length in bytes
+// counted in bits.
+constexpr auto powers() -> std::array<uint32_t, 64 + 3> {
+  std::array<uint32_t, 64 + 3> pow{};
+  uint32_t p = 1u << 30;  // x^1
+  for (auto& it : pow) {
+    it = p;
+    p = multiply(p, p);
+  }
+  return pow;
+}
+
+constexpr auto POWERS = powers();
+
+}  // namespace detail
+
+// Checksum of `ab` from those of `a` and `b`, `size` being the length of
+// `b`, so pieces checked on different threads add up to the whole.
+constexpr auto combine(uint32_t a, uint32_t b, uint64_t size) -> uint32_t {
+  uint32_t shift = 1u << 31;  // x^0
+  for (size_t n = 3; size != 0; size >>= 1, ++n) {
+    if (size & 1)
+      shift = detail::multiply(detail::POWERS[n], shift);
+  }
+  return detail::multiply(shift, a) ^ b;
+}
+
+}  // namespace bar::crc
@@ -17,12 +17,24 @@ class entry {
   entry(fs::path path, header_t header) : path_(std::move(path)), header_(header) {}
 
   auto& path() const { return path_; }
-  fs::perms perms() const { return static_cast<fs::perms>(header_.mode); }
+  fs::perms perms() const { return static_cast<fs::perms>(header_.mode) & fs::perms::mask; }
+
+  int64_t mtime() const { return header_.mtime; }
 
   uint64_t size() const { return header_.data; }
+  // Bytes following the path: the payload and its checksum, if any.
+  uint64_t stored_size() const { return size() + (has_crc() ? sizeof(checksum::repr) : 0); }
 
   bool is_dir() const { return header_.type == entry_type::dir; }
   bool is_reg() const { return header_.type == entry_type::reg; }
+  bool is_del() const { return header_.type == entry_type::del; }
+  bool is_sym() const { return header_.type == entry_type::sym; }
+  bool is_link() const { return header_.type == entry_type::link; }
+
+  bool is_compressed() const { return header_.flags & flag::lz; }
+  bool is_chunked() const { return header_.flags & flag::cdc; }
+  bool is_sparse() const { return header_.flags & flag::sparse; }
+  bool has_crc() const { return header_.flags & flag::crc; }
 
   header_t header() const { return header_; }
 };
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "crc.hxx"
+#include "entry.hxx"
+#include "lz.hxx"
+#include "pool.hxx"
+#include "stats.hxx"
+#include "sys.hxx"
+#include "target.hxx"
+
+#include <sys/stat.h>
+
+namespace bar {
+
+// Parallel extraction: the caller walks the headers (sequentially or from the
+// index) and hands every entry with its data offset to `unpack`. Directories
+// and parents are resolved right away, in archive order, so they always exist
+// before their children; file contents are copied by the pool from a shared
+// archive descriptor, with `copy_file_range` where the filesystems allow it.
+class extractor {
+  sys::fd archive_;
+  target& dest_;
+  bar::stats* stats_;
+  pool pool_;
+
+  // Symlinks and hard links wait for the pool to be idle: a hard link needs
+  // its target written, and neither may race an earlier version of its path.
+  struct pending_link {
+    bar::entry entry;
+    std::string to;
+  };
+  std::vector<pending_link> links_;
+  std::unordered_set<std::string> linked_;  // paths in `links_`
+  // files handed to the pool since it was last idle, a later version of one
+  // of them waits for it
+  std::unordered_set<std::string> queued_;
+
+  constexpr static size_t BUF_SIZE = 256 * 1024;
+
+  void drain() {
+    pool_.wait();
+    queued_.clear();
+  }
+
+  void make_links() {
+    if (links_.empty())
+      return;
+    drain();
+    stats::timer meta(stats_, stats::phase::metadata);
+    for (const auto& [entry, to] : links_) {
+      if (entry.is_sym())
+        dest_.symlink(entry.path(), to, entry);
+      else
+        dest_.link(entry.path(), to);
+    }
+    links_.clear();
+    linked_.clear();
+  }
+
+  // Path a symlink or hard link entry at `offset` points to.
+  auto read_target(const entry& entry, uint64_t offset) -> std::string {
+    std::string to;
+    if (entry.size() <= entry::MAX_NAME) {
+      to.resize(entry.size());
+      if (sys::pread_all(archive_.get(), to.data(), to.size(), offset) == to.size())
+        return to;
+    }
+    throw std::runtime_error("corrupt bar archive: bad link in '" + entry.path().string() +
+                             "'");
+  }
+
+  void write_file(const target::place& at, const entry& entry, uint64_t offset,
+                  bool sync) {
+    stats::timer timer(stats_, stats::phase::payload);
+    if (sync && target::current(at, entry, stored_crc(entry, offset)))
+      return;
+    const auto& full_path = at.path;
+    sys::fd out;
+    {
+      stats::timer meta(stats_, stats::phase::metadata);
+      out = target::create(at);
+    }
+
+    // checked as it is copied; a file that doesn't match or decode is dropped
+    uint32_t crc = 0;
+    auto* sum = entry.has_crc() ? &crc : nullptr;
+    try {
+      if (entry.is_sparse()) {
+        unsparse(out.get(), entry.size(), offset, full_path, sum);
+      } else if (entry.is_chunked()) {
+        unchunk(out.get(), entry.size(), offset, full_path, sum);
+      } else {
+        copy(out.get(), entry.size(), offset, full_path, sum);
+      }
+      if (sum && stored_crc(entry, offset) != crc)
+        throw std::runtime_error("corrupt bar archive: checksum mismatch in '" +
+                                 entry.path().string() + "'");
+    } catch (...) {
+      target::discard(at);
+      throw;
+    }
+
+    stats::timer meta(stats_, stats::phase::metadata);
+    target::restore(out.get(), entry, full_path);
+    target::commit(at);
+  }
+
+  // Checksum stored after the payload of `entry` at `offset`, if any.
+  auto stored_crc(const entry& entry, uint64_t offset) -> std::optional<uint32_t> {
+    checksum::repr tail;
+    if (!entry.has_crc() || sys::pread_all(archive_.get(), &tail, sizeof(tail),
+                                           offset + entry.size()) != sizeof(tail))
+      return std::nullopt;
+    return sys::read_crc(&tail);
+  }
+
+  // Appends `size` bytes of the archive at `offset` to `out`, inside the
+  // kernel unless they are folded into the checksum `crc`.
+  void copy(int out, uint64_t size, uint64_t offset, const fs::path& path,
+            uint32_t* crc = nullptr) {
+    auto at = static_cast<off_t>(offset);
+    uint64_t done = crc ? 0 : sys::transfer(archive_.get(), &at, out, size);
+
+    thread_local std::vector<char> buf(BUF_SIZE);
+    while (done < size) {
+      const auto want = std::min<uint64_t>(size - done, buf.size());
+      const auto n = sys::pread_all(archive_.get(), buf.data(), want, offset + done);
+      if (n == 0)
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      if (crc)
+        *crc = crc::crc32c(*crc, buf.data(), n);
+      if (!sys::write_all(out, buf.data(), n))
+        sys::fail("write", path);
+      done += n;
+    }
+  }
+
+  // Walks the chunk records of a `flag::cdc` payload, references are plain
+  // copies from elsewhere in the archive. The payload itself, not what the
+  // references point to, is folded into `crc`.
+  void unchunk(int out, uint64_t size, uint64_t offset, const fs::path& path,
+               uint32_t* crc = nullptr) {
+    const auto end = offset + size;
+    while (end - offset >= sizeof(chunk::repr)) {
+      chunk::repr rec;
+      if (sys::pread_all(archive_.get(), &rec, sizeof(rec), offset) != sizeof(rec))
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      const auto chunk = sys::read_chunk(&rec);
+      offset += sizeof(rec);
+      if (crc)
+        *crc = crc::crc32c(*crc, &rec, sizeof(rec));
+
+      if (chunk.ref == 0) {
+        if (chunk.size > end - offset)
+          throw std::runtime_error("corrupt bar archive: bad chunk");
+        copy(out, chunk.size, offset, path, crc);
+        offset += chunk.size;
+      } else {
+        copy(out, chunk.size, chunk.ref, path);
+      }
+    }
+  }
+
+  // Writes the extents of a `flag::sparse` payload at their offsets and sets
+  // the size, leaving the holes unwritten. The payload is folded into `crc`
+  // in order: the head, the extent map, then the data.
+  void unsparse(int out, uint64_t size, uint64_t offset, const fs::path& path,
+                uint32_t* crc = nullptr) {
+    sparse::repr head_buf;
+    if (size < sizeof(head_buf) ||
+        sys::pread_all(archive_.get(), &head_buf, sizeof(head_buf), offset) != sizeof(head_buf))
+      throw std::runtime_error("corrupt bar archive: truncated payload");
+    const auto head = sys::read_sparse(&head_buf);
+    const auto end = offset + size;
+    offset += sizeof(head_buf);
+    if (head.count > (end - offset) / sizeof(extent::repr))
+      throw std::runtime_error("corrupt bar archive: bad extent map");
+
+    std::vector<extent::repr> map(head.count);
+    const auto map_size = map.size() * sizeof(extent::repr);
+    if (sys::pread_all(archive_.get(), map.data(), map_size, offset) != map_size)
+      throw std::runtime_error("corrupt bar archive: truncated payload");
+    if (crc) {
+      *crc = crc::crc32c(*crc, &head_buf, sizeof(head_buf));
+      *crc = crc::crc32c(*crc, map.data(), map_size);
+    }
+
+    auto data_at = offset + map_size;
+    for (const auto& rec : map) {
+      const auto ext = sys::read_extent(&rec);
+      if (ext.length > end - data_at || ext.offset > head.size ||
+          ext.length > head.size - ext.offset)
+        throw std::runtime_error("corrupt bar archive: bad extent");
+
+      if (::lseek(out, static_cast<off_t>(ext.offset), SEEK_SET) < 0)
+        sys::fail("lseek", path);
+      copy(out, ext.length, data_at, path, crc);
+      data_at += ext.length;
+    }
+    if (::ftruncate(out, static_cast<off_t>(head.size)) != 0)
+      sys::fail("ftruncate", path);
+  }
+
+  // Output shared by the block jobs of one file. Whoever finishes last
+  // checks the payload against `stored`, the checksum after it, and
+  // restores the metadata, as any later write would bump the mtime.
+  struct shared_file {
+    sys::fd fd;
+    bar::entry entry;
+    target::place at;
+    std::optional<uint32_t> stored;
+    // checksum and size of every framed block in order, filled in by the
+    // jobs; a deque, so a slot stays put while the submitter adds more
+    std::deque<std::pair<uint32_t, uint64_t>> sums;
+    std::atomic<size_t> pending = 1;  // jobs, plus one for the submitter
+
+    void done(bar::stats* s) {
+      if (pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+      if (entry.has_crc()) {
+        uint32_t crc = 0;
+        for (const auto& [sum, size] : sums)
+          crc = crc::combine(crc, sum, size);
+        if (stored != crc) {
+          target::discard(at);
+          throw std::runtime_error("corrupt bar archive: checksum mismatch in '" +
+                                   entry.path().string() + "'");
+        }
+      }
+      stats::timer meta(s, stats::phase::metadata);
+      target::restore(fd.get(), entry, at.path);
+      target::commit(at);
+    }
+  };
+
+  // Blocks of a compressed file are independent: each one becomes a job that
+  // decodes it and writes at its own offset, so big files use every thread.
+  void unpack_lz(const target::place& at, const entry& entry, uint64_t offset) {
+    if (dest_.syncing() && target::current(at, entry, std::nullopt))
+      return;
+    std::shared_ptr<shared_file> out;
+    {
+      stats::timer meta(stats_, stats::phase::metadata);
+      out = std::make_shared<shared_file>(target::create(at), entry, at,
+                                          stored_crc(entry, offset));
+    }
+
+    // a file that fails to decode is dropped, whichever thread finds out
+    const auto end = offset + entry.size();
+    uint64_t raw_at = 0;
+    try {
+      while (end - offset >= sizeof(block::repr)) {
+        block::repr frame;
+        if (sys::pread_all(archive_.get(), &frame, sizeof(frame), offset) != sizeof(frame))
+          throw std::runtime_error("corrupt bar archive: truncated payload");
+        const auto block = sys::read_block(&frame);
+        offset += sizeof(frame);
+        if (block.raw > block::SIZE || block.packed > end - offset || block.packed > block.raw)
+          throw std::runtime_error("corrupt bar archive: bad block frame");
+
+        // blocks finish in any order, their checksums are combined at the end
+        auto* sum = entry.has_crc() ? &out->sums.emplace_back(0, sizeof(frame) + block.packed)
+                                    : nullptr;
+        if (sum)
+          sum->first = crc::crc32c(0, &frame, sizeof(frame));
+
+        out->pending.fetch_add(1, std::memory_order_relaxed);
+        pool_.submit([this, out, block, offset, raw_at, sum] {
+          stats::timer timer(stats_, stats::phase::payload);
+          try {
+            unpack_block(*out, block, offset, raw_at, sum);
+          } catch (...) {
+            target::discard(out->at);
+            throw;
+          }
+          out->done(stats_);
+        });
+        offset += block.packed;
+        raw_at += block.raw;
+      }
+      if (offset != end)
+        throw std::runtime_error("corrupt bar archive: bad block frame");
+    } catch (...) {
+      target::discard(out->at);
+      throw;
+    }
+    out->done(stats_);
+  }
+
+  // Decodes the framed block at `offset` into `out` at `raw_at`, folding its
+  // bytes into `sum` if given.
+  void unpack_block(shared_file& out, block_t block, uint64_t offset, uint64_t raw_at,
+                    std::pair<uint32_t, uint64_t>* sum) {
+    thread_local std::vector<char> packed, raw;
+    packed.resize(block.packed);
+    if (sys::pread_all(archive_.get(), packed.data(), block.packed, offset) != block.packed)
+      throw std::runtime_error("corrupt bar archive: truncated payload");
+    if (sum)
+      sum->first = crc::crc32c(sum->first, packed.data(), block.packed);
+
+    const char* data = packed.data();
+    if (block.packed < block.raw) {
+      raw.resize(block.raw);
+      if (lz::decompress(packed.data(), block.packed, raw.data(), raw.size()) != block.raw)
+        throw std::runtime_error("corrupt bar archive: bad lz block");
+      data = raw.data();
+    }
+    if (!sys::pwrite_all(out.fd.get(), data, block.raw, raw_at))
+      sys::fail("pwrite", out.at.path);
+  }
+
+ public:
+  // `archive` must be a regular file, it is read with `pread` from every thread.
+  extractor(sys::fd archive, target& dest, size_t jobs, bar::stats* stats = nullptr)
+      : archive_(std::move(archive)), dest_(dest), stats_(stats), pool_(jobs) {}
+
+  extractor(const fs::path& archive, target& dest, size_t jobs,
+            bar::stats* stats = nullptr)
+      : extractor(sys::open(archive, O_RDONLY), dest, jobs, stats) {}
+
+  void unpack(const entry& entry, uint64_t offset) {
+    if (stats_)
+      stats_->entry(entry.stored_size());
+
+    // an earlier version of this path may still be pending
+    auto path = entry.path().generic_string();
+    if (linked_.contains(path))
+      make_links();
+    else if (queued_.contains(path))
+      drain();
+
+    if (entry.is_del()) {
+      // earlier versions may still be in flight
+      make_links();
+      drain();
+      stats::timer meta(stats_, stats::phase::metadata);
+      dest_.remove(entry.path());
+    } else if (entry.is_dir()) {
+      stats::timer meta(stats_, stats::phase::metadata);
+      dest_.directory(entry.path(), entry);
+    } else if (entry.is_sym() || entry.is_link()) {
+      linked_.insert(std::move(path));
+      links_.push_back({entry, read_target(entry, offset)});
+    } else if (entry.is_reg()) {
+      target::place at;
+      {
+        stats::timer meta(stats_, stats::phase::metadata);
+        at = dest_.locate(entry.path());
+      }
+      queued_.insert(std::move(path));
+      if (entry.is_compressed()) {
+        unpack_lz(at, entry, offset);
+        return;
+      }
+      pool_.submit([this, at = std::move(at), entry, offset, sync = dest_.syncing()] {
+        write_file(at, entry, offset, sync);
+      });
+    }
+  }
+
+  // Waits for the pool and makes the pending links. Directory metadata is
+  // left to `target::finish`.
+  void wait() {
+    make_links();
+    drain();
+  }
+};
+
+}  // namespace bar
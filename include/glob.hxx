@@ -0,0 +1,185 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bar {
+
+// Path filter compiled from shell patterns: `*` and `?` stay within one
+// component, `[a-z]` / `[!a-z]` are classes, `\` escapes and `**` spans any
+// number of components. A pattern without a `/` is tried at every depth, and
+// a pattern matching a directory selects everything below it. The literal
+// leading components are kept as a prefix, so most paths are rejected with
+// one comparison.
+class glob {
+  struct pattern {
+    std::string prefix;                 // literal leading components
+    std::vector<std::string> segments;  // the rest, `**` kept as is
+  };
+
+  std::vector<pattern> patterns_;
+
+  static auto is_literal(std::string_view seg) -> bool {
+    return seg.find_first_of("*?[\\") == std::string_view::npos;
+  }
+
+  static void split(std::string_view path, std::vector<std::string_view>& parts) {
+    parts.clear();
+    while (!path.empty()) {
+      const auto slash = path.find('/');
+      if (auto part = path.substr(0, slash); !part.empty() && part != ".")
+        parts.push_back(part);
+      if (slash == std::string_view::npos)
+        break;
+      path.remove_prefix(slash + 1);
+    }
+  }
+
+  // Matches `[...]` at the start of `pat` against `c`, advancing `pat` past
+  // it. An unterminated class is taken literally, like the shell does.
+  static auto match_class(std::string_view& pat, char c) -> bool {
+    size_t at = 1;
+    const bool negate = at < pat.size() && (pat[at] == '!' || pat[at] == '^');
+    if (negate)
+      at++;
+
+    bool found = false;
+    for (bool first = true; at < pat.size() && (first || pat[at] != ']'); first = false) {
+      char lo = pat[at++];
+      if (lo == '\\' && at < pat.size())
+        lo = pat[at++];
+      char hi = lo;
+      if (at + 1 < pat.size() && pat[at] == '-' && pat[at + 1] != ']') {
+        hi = pat[at + 1];
+        at += 2;
+        if (hi == '\\' && at < pat.size())
+          hi = pat[at++];
+      }
+      found |= lo <= c && c <= hi;
+    }
+    if (at >= pat.size()) {
+      pat.remove_prefix(1);
+      return c == '[';
+    }
+    pat.remove_prefix(at + 1);
+    return found != negate;
+  }
+
+  // One component against one pattern segment, backtracking on the last `*`.
+  static auto match_segment(std::string_view pat, std::string_view name) -> bool {
+    std::string_view star_pat, star_name;
+    bool star = false;
+
+    while (!name.empty()) {
+      if (!pat.empty() && pat[0] == '*') {
+        pat.remove_prefix(1);
+        star = true;
+        star_pat = pat;
+        star_name = name;
+        continue;
+      }
+
+      bool ok = false;
+      if (!pat.empty()) {
+        if (pat[0] == '?') {
+          pat.remove_prefix(1);
+          ok = true;
+        } else if (pat[0] == '[') {
+          ok = match_class(pat, name[0]);
+        } else {
+          if (pat[0] == '\\' && pat.size() > 1)
+            pat.remove_prefix(1);
+          ok = pat[0] == name[0];
+          pat.remove_prefix(1);
+        }
+      }
+      if (ok) {
+        name.remove_prefix(1);
+        continue;
+      }
+      if (!star)
+        return false;
+      // let the last star eat one more character
+      pat = star_pat;
+      star_name.remove_prefix(1);
+      name = star_name;
+    }
+    return pat.find_first_not_of('*') == std::string_view::npos;
+  }
+
+  // Segments against components; running out of segments is a match, so
+  // a directory selects its contents.
+  static auto match(std::span<const std::string> segs,
+                    std::span<const std::string_view> parts) -> bool {
+    while (!segs.empty()) {
+      if (segs[0] == "**") {
+        for (size_t skip = 0; skip <= parts.size(); ++skip) {
+          if (match(segs.subspan(1), parts.subspan(skip)))
+            return true;
+        }
+        return false;
+      }
+      if (parts.empty() || !match_segment(segs[0], parts[0]))
+        return false;
+      segs = segs.subspan(1);
+      parts = parts.subspan(1);
+    }
+    return true;
+  }
+
+ public:
+  glob() = default;
+
+  explicit glob(const std::vector<std::string>& patterns) {
+    for (const auto& text : patterns) {
+      pattern pat;
+      if (text.find('/') == std::string::npos)
+        pat.segments.emplace_back("**");
+
+      std::vector<std::string_view> parts;
+      split(text, parts);
+      bool literal = pat.segments.empty();
+      for (auto seg : parts) {
+        if (literal && is_literal(seg)) {
+          pat.prefix += pat.prefix.empty() ? "" : "/";
+          pat.prefix += seg;
+        } else {
+          literal = false;
+          pat.segments.emplace_back(seg);
+        }
+      }
+      patterns_.push_back(std::move(pat));
+    }
+  }
+
+  // Whether there are no patterns, every path matches then.
+  bool empty() const { return patterns_.empty(); }
+
+  auto matches(std::string_view path) const -> bool {
+    if (patterns_.empty())
+      return true;
+
+    std::vector<std::string_view> parts;
+    for (const auto& pat : patterns_) {
+      auto rest = path;
+      if (!pat.prefix.empty()) {
+        if (!rest.starts_with(pat.prefix))
+          continue;
+        rest.remove_prefix(pat.prefix.size());
+        if (!rest.empty() && rest[0] != '/')
+          continue;
+      }
+      if (pat.segments.empty())
+        return true;
+
+      split(rest, parts);
+      if (match(pat.segments, parts))
+        return true;
+    }
+    return false;
+  }
+};
+
+}  // namespace bar
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "sys.hxx"
+
+// xxHash64. The bulk loop keeps four independent accumulators, so the
+// multiplies of consecutive stripes overlap instead of forming one chain.
+namespace bar::hash {
+
+namespace detail {
+
+constexpr uint64_t P1 = 0x9e3779b185ebca87ull;
+constexpr uint64_t P2 = 0xc2b2ae3d27d4eb4full;
+constexpr uint64_t P3 = 0x165667b19e3779f9ull;
+constexpr uint64_t P4 = 0x85ebca77c2b2ae63ull;
+constexpr uint64_t P5 = 0x27d4eb2f165667c5ull;
+
+inline auto read64(const uint8_t* at) -> uint64_t {
+  uint64_t val;
+  std::memcpy(&val, at, sizeof(val));
+  return sys::from_le(val);
+}
+
+inline auto read32(const uint8_t* at) -> uint32_t {
+  uint32_t val;
+  std::memcpy(&val, at, sizeof(val));
+  return sys::from_le(val);
+}
+
+constexpr auto round(uint64_t acc, uint64_t lane) -> uint64_t {
+  return std::rotl(acc + lane * P2, 31) * P1;
+}
+
+constexpr auto merge(uint64_t acc, uint64_t val) -> uint64_t {
+  return (acc ^ round(0, val)) * P1 + P4;
+}
+
+}  // namespace detail
+
+inline auto xxh64(const void* data, size_t size, uint64_t seed = 0) -> uint64_t {
+  using namespace detail;
+
+  const auto* at = static_cast<const uint8_t*>(data);
+  const auto* end = at + size;
+  uint64_t acc;
+
+  if (size >= 32) {
+    uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+    for (const auto* limit = end - 32; at <= limit; at += 32) {
+      v1 = round(v1, read64(at));
+      v2 = round(v2, read64(at + 8));
+      v3 = round(v3, read64(at + 16));
+      v4 = round(v4, read64(at + 24));
+    }
+    acc = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+    acc = merge(merge(merge(merge(acc, v1), v2), v3), v4);
+  } else {
+    acc = seed + P5;
+  }
+  acc += size;
+
+  for (; at + 8 <= end; at += 8) {
+    acc = std::rotl(acc ^ round(0, read64(at)), 27) * P1 + P4;
+  }
+  if (at + 4 <= end) {
+    acc = std::rotl(acc ^ (read32(at) * P1), 23) * P2 + P3;
+    at += 4;
+  }
+  for (; at < end; at++) {
+    acc = std::rotl(acc ^ (*at * P5), 11) * P1;
+  }
+
+  acc ^= acc >> 33;
+  acc *= P2;
+  acc ^= acc >> 29;
+  acc *= P3;
+  acc ^= acc >> 32;
+  return acc;
+}
+
+}  // namespace bar::hash
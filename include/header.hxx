@@ -2,17 +2,60 @@
 
 #include <cstdint>
 #include <array>
+#include <optional>
 
 namespace bar {
 
 constexpr std::array<uint8_t, 4> BAR = {0xf0, 0x9f, 0x8d, 0xbe};
+constexpr std::array<uint8_t, 4> BAR_V2 = {0xf0, 0x9f, 0xa5, 0x82};
 
-enum struct entry_type : uint8_t { reg = 0, dir = 1, sym = 2 };
+// Layout of entry headers and index records, told apart by the magic at
+// both ends of the archive. v1 stores a fixed `header::repr` and the whole
+// path; v2 stores varints and front-coded paths, see `codec`.
+enum struct format : uint8_t { v1 = 1, v2 = 2 };
+
+constexpr auto magic(format f) -> const std::array<uint8_t, 4>& {
+  return f == format::v1 ? BAR : BAR_V2;
+}
+
+constexpr auto format_of(const std::array<uint8_t, 4>& magic) -> std::optional<format> {
+  if (magic == BAR)
+    return format::v1;
+  if (magic == BAR_V2)
+    return format::v2;
+  return std::nullopt;
+}
+
+// `del` is a tombstone: the path was removed by a later `bar a --update`.
+// `pad` is filler in front of an entry whose payload had to be aligned.
+// The payload of `sym` is the symlink target; the payload of `link` is the
+// path of an earlier entry sharing its inode, a hard link.
+enum struct entry_type : uint8_t {
+  reg = 0,
+  dir = 1,
+  sym = 2,
+  index = 3,
+  del = 4,
+  pad = 5,
+  link = 6
+};
+
+// Boundary for aligned payloads, the block size of common filesystems, so
+// they can be cloned and mapped in place.
+constexpr uint64_t ALIGN = 4 << 10;
+
+// Bits of `header_t::flags`, unknown bits are reserved.
+namespace flag {
+constexpr uint8_t lz = 1 << 0;      // payload is a run of lz compressed blocks
+constexpr uint8_t cdc = 1 << 1;     // payload is a list of deduplicated chunks
+constexpr uint8_t crc = 1 << 2;     // payload is followed by its crc32c
+constexpr uint8_t sparse = 1 << 3;  // payload is an extent map and the extents
+}  // namespace flag
 
 #pragma pack(push, 1)
 struct header_t {
   entry_type type;
-  uint8_t _____;  // reserved for 40 bytes
+  uint8_t flags;
   int64_t mtime;
   uint16_t path;
   uint32_t mode;
@@ -26,4 +69,83 @@ struct header {
   using repr = std::array<uint8_t, sizeof(header_t)>;
 };
 
+// Fixed-size footer: the last bytes of an indexed archive. Points back to the
+// `entry_type::index` entry, so readers can find it with a single seek.
+#pragma pack(push, 1)
+struct trailer_t {
+  uint64_t index;  // offset of the index header
+  uint64_t count;  // records in the index
+  uint32_t _____;  // reserved
+  std::array<uint8_t, 4> magic;  // same as the leading one
+};  // 8 + 8 + 4 + 4
+#pragma pack(pop)
+
+static_assert(sizeof(trailer_t) == 24);
+
+struct trailer {
+  using repr = std::array<uint8_t, sizeof(trailer_t)>;
+};
+
+// Frame of one independently compressed block of a `flag::lz` payload, so
+// both sides can spread the blocks over threads.
+#pragma pack(push, 1)
+struct block_t {
+  uint32_t raw;     // uncompressed size
+  uint32_t packed;  // stored size, the block is stored as is when equal to `raw`
+};
+#pragma pack(pop)
+
+static_assert(sizeof(block_t) == 8);
+
+struct block {
+  using repr = std::array<uint8_t, sizeof(block_t)>;
+  constexpr static uint32_t SIZE = 1 << 20;  // raw bytes per block
+};
+
+// Record of a `flag::cdc` payload: a chunk whose bytes follow right after,
+// or a reference to the bytes of an identical chunk stored earlier.
+#pragma pack(push, 1)
+struct chunk_t {
+  uint64_t ref;  // absolute offset of the chunk bytes, 0 when they follow
+  uint32_t size;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(chunk_t) == 12);
+
+struct chunk {
+  using repr = std::array<uint8_t, sizeof(chunk_t)>;
+};
+
+// Head of a `flag::sparse` payload: `count` extents follow, then the bytes of
+// every extent in order. The rest of the `size` bytes of the file are holes.
+#pragma pack(push, 1)
+struct sparse_t {
+  uint64_t size;   // logical file size
+  uint64_t count;  // extents
+};
+
+struct extent_t {
+  uint64_t offset;
+  uint64_t length;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(sparse_t) == 16);
+static_assert(sizeof(extent_t) == 16);
+
+struct sparse {
+  using repr = std::array<uint8_t, sizeof(sparse_t)>;
+};
+
+struct extent {
+  using repr = std::array<uint8_t, sizeof(extent_t)>;
+};
+
+// Little-endian crc32c of the stored payload bytes, right after a payload
+// with `flag::crc`. Not counted in `header_t::data`.
+struct checksum {
+  using repr = std::array<uint8_t, sizeof(uint32_t)>;
+};
+
 }  // namespace bar
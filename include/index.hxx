@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "codec.hxx"
+#include "entry.hxx"
+#include "sys.hxx"
+
+namespace bar {
+
+// Central index written by `bottle` at the end of an archive: header, path
+// and data offset of every entry, so readers don't have to walk the payloads.
+//
+// v1 record: header::repr | u64 data offset | path bytes
+// v2 record: varint data offset | header and path as written by `codec`
+class index {
+ public:
+  struct record {
+    header_t header;
+    uint64_t offset;  // absolute offset of the entry data
+    std::string_view path;
+    uint64_t raw;  // file size, see `codec::raw`
+
+    auto to_entry() const -> entry { return {fs::path(path), header}; }
+  };
+
+  constexpr static auto RECORD = sizeof(header::repr) + sizeof(uint64_t);
+
+ private:
+  std::vector<char> paths_;  // every path back to back
+  std::vector<record> records_;
+  std::vector<bool> live_;
+  std::unordered_map<std::string_view, size_t> by_path_;
+
+ public:
+  index() = default;
+  index(index&&) = default;
+  auto operator=(index&&) -> index& = default;
+  // records view `paths_`, so copies would dangle
+  index(const index&) = delete;
+  auto operator=(const index&) -> index& = delete;
+
+  // Appends a record to `out`, whose records are all encoded with `codec`.
+  // `raw` is the file size, which only v2 keeps.
+  static void encode(codec& codec, std::vector<char>& out, const header_t& header,
+                     uint64_t offset, std::string_view path, uint64_t raw) {
+    if (codec.format() == format::v2) {
+      varint::put(out, offset);
+      codec.put(out, header, path, raw);
+      return;
+    }
+
+    const auto at = out.size();
+    out.resize(at + RECORD + path.size());
+
+    header::repr buf;
+    sys::write_header(&buf, header);
+    std::memcpy(out.data() + at, &buf, sizeof(buf));
+
+    offset = sys::to_le(offset);
+    std::memcpy(out.data() + at + sizeof(buf), &offset, sizeof(offset));
+    std::memcpy(out.data() + at + RECORD, path.data(), path.size());
+  }
+
+  // Checks the trailer of an archive of `size` bytes in `format`, nullopt
+  // when it has none.
+  static auto locate(const trailer::repr& tail, uint64_t size, format format)
+      -> std::optional<trailer_t> {
+    if (size < sizeof(BAR) + codec(format).min_size() + sizeof(tail))
+      return std::nullopt;
+
+    trailer_t trailer = sys::read_trailer(&tail);
+    if (trailer.magic != magic(format) || trailer.index < sizeof(BAR) ||
+        trailer.index > size - codec(format).min_size() - sizeof(tail)) {
+      return std::nullopt;
+    }
+    return trailer;
+  }
+
+  // `raw` spans from the index header to the end of the archive.
+  static auto decode(std::span<const char> raw, const trailer_t& trailer, format format)
+      -> std::optional<index> {
+    if (raw.size() < sizeof(trailer::repr))
+      return std::nullopt;
+    raw = raw.first(raw.size() - sizeof(trailer::repr));
+
+    codec head(format);
+    auto at = raw;
+    const auto header = head.get([&](void* data, size_t size) {
+      if (at.size() < size)
+        return false;
+      std::memcpy(data, at.data(), size);
+      at = at.subspan(size);
+      return true;
+    });
+    if (!header || header->type != entry_type::index ||
+        header->data != at.size() + sizeof(trailer::repr))
+      return std::nullopt;
+
+    index idx;
+    if (!idx.parse(at, trailer.count, format))
+      return std::nullopt;
+    return idx;
+  }
+
+  // Index over records built by hand with `encode`, e.g. from a scan.
+  static auto build(std::span<const char> records, uint64_t count, format format)
+      -> std::optional<index> {
+    index idx;
+    if (!idx.parse(records, count, format))
+      return std::nullopt;
+    return idx;
+  }
+
+  auto& records() const { return records_; }
+  auto size() const { return records_.size(); }
+
+  // Whether `rec`, one of `records()`, is the live version of its path: not
+  // shadowed by a later record and not a tombstone.
+  auto is_live(const record& rec) const -> bool { return live_[&rec - records_.data()]; }
+
+  auto find(std::string_view path) const -> const record* {
+    if (auto it = by_path_.find(path); it != by_path_.end()) {
+      return &records_[it->second];
+    }
+    return nullptr;
+  }
+
+ private:
+  auto parse(std::span<const char> raw, uint64_t count, format format) -> bool {
+    codec dec(format);
+    const auto min = format == format::v1 ? RECORD : dec.min_size() + 1;
+    if (count > raw.size() / min)
+      return false;
+    records_.reserve(count);
+    by_path_.reserve(count);
+
+    const char* at = raw.data();
+    const char* end = at + raw.size();
+    auto read = [&](void* data, size_t size) {
+      if (static_cast<size_t>(end - at) < size)
+        return false;
+      std::memcpy(data, at, size);
+      at += size;
+      return true;
+    };
+    auto next = [&]() -> std::optional<uint8_t> {
+      if (at == end)
+        return std::nullopt;
+      return static_cast<uint8_t>(*at++);
+    };
+
+    // paths are decoded into `paths_` and viewed once it stops growing
+    std::vector<size_t> starts;
+    starts.reserve(count);
+    for (uint64_t i = 0; i < count; ++i) {
+      record rec{};
+      if (format == format::v2) {
+        const auto offset = varint::get(next);
+        const auto header = offset ? dec.get(read) : std::nullopt;
+        if (!header)
+          return false;
+        rec.header = *header;
+        rec.offset = *offset;
+        rec.raw = dec.raw();
+      } else {
+        header::repr buf;
+        if (!read(&buf, sizeof(buf)) || !read(&rec.offset, sizeof(rec.offset)))
+          return false;
+        rec.header = sys::read_header(&buf);
+        rec.offset = sys::from_le(rec.offset);
+        rec.raw = rec.header.data;
+        if (static_cast<size_t>(end - at) < rec.header.path)
+          return false;
+      }
+      const auto path = format == format::v2 ? dec.path() : std::string_view(at, rec.header.path);
+      if (format == format::v1)
+        at += path.size();
+
+      starts.push_back(paths_.size());
+      paths_.insert(paths_.end(), path.begin(), path.end());
+      records_.push_back(rec);
+    }
+
+    live_.assign(records_.size(), false);
+    for (size_t i = 0; i < records_.size(); ++i) {
+      auto& rec = records_[i];
+      rec.path = std::string_view(paths_.data() + starts[i], rec.header.path);
+      // later entries with the same path shadow earlier ones
+      const auto [it, fresh] = by_path_.try_emplace(rec.path, i);
+      if (!fresh)
+        live_[std::exchange(it->second, i)] = false;
+      if (rec.header.type == entry_type::del) {
+        by_path_.erase(it);
+      } else {
+        live_[i] = true;
+      }
+    }
+    return true;
+  }
+};
+
+}  // namespace bar
@@ -0,0 +1,681 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "header.hxx"
+#include "sys.hxx"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+namespace fs = std::filesystem;
+
+// Byte sinks and sources the archive is written to and read from. Plain
+// virtual calls over big buffers, no locale or sentry per call, and the
+// capabilities that matter for fast paths: whether the bytes can be
+// revisited (`seekable`) and whether a descriptor can move them inside the
+// kernel (`fd`). Failures throw.
+namespace bar::io {
+
+namespace detail {
+
+constexpr size_t BUF_SIZE = 1 << 20;
+
+struct aligned_free {
+  void operator()(char* ptr) const { std::free(ptr); }
+};
+
+// Block aligned, so the buffer can later be handed to O_DIRECT descriptors.
+inline auto aligned_buffer() -> std::unique_ptr<char, aligned_free> {
+  auto* ptr = static_cast<char*>(std::aligned_alloc(ALIGN, BUF_SIZE));
+  if (!ptr)
+    throw std::bad_alloc();
+  return std::unique_ptr<char, aligned_free>(ptr);
+}
+
+}  // namespace detail
+
+class sink {
+ public:
+  virtual ~sink() = default;
+
+  // Appends `size` bytes.
+  virtual void write(const void* data, size_t size) = 0;
+
+  // Pushes buffered bytes down to the descriptor, if any.
+  virtual void flush() {}
+
+  // Whether bytes already written can be overwritten with `patch`.
+  virtual bool seekable() const { return false; }
+
+  // Overwrites `size` bytes at `offset`, which were written before.
+  virtual void patch(uint64_t offset, const void* data, size_t size) {
+    (void)offset, (void)data, (void)size;
+    throw std::logic_error("sink is not seekable");
+  }
+
+  // Appends `size` bytes left for the caller to fill in later with `pwrite`
+  // on `fd()`. Only on seekable sinks.
+  virtual void reserve(uint64_t size) {
+    (void)size;
+    throw std::logic_error("sink is not seekable");
+  }
+
+  // Appends up to `size` bytes of `in`, read at `*in_off` if given, without
+  // copying them through userspace. Returns how many, 0 if it can't.
+  virtual auto receive(int in, off_t* in_off, uint64_t size) -> uint64_t {
+    (void)in, (void)in_off, (void)size;
+    return 0;
+  }
+
+  // Underlying descriptor, -1 if there is none.
+  virtual auto fd() const -> int { return -1; }
+};
+
+class source {
+ public:
+  virtual ~source() = default;
+
+  // Reads up to `size` bytes, short only at the end.
+  virtual auto read(void* data, size_t size) -> size_t = 0;
+
+  // Moves `size` bytes forward, a seek where possible.
+  virtual void skip(uint64_t size) = 0;
+
+  // Offset of the next byte `read` returns.
+  virtual auto tell() const -> uint64_t = 0;
+
+  // Whether `seek`, `size` and `pread` work.
+  virtual bool seekable() const { return false; }
+
+  virtual void seek(uint64_t offset) {
+    (void)offset;
+    throw std::logic_error("source is not seekable");
+  }
+
+  virtual auto size() const -> uint64_t { return 0; }
+
+  // Reads at `offset` without moving `tell()`.
+  virtual auto pread(void* data, size_t size, uint64_t offset) -> size_t {
+    (void)data, (void)size, (void)offset;
+    throw std::logic_error("source is not seekable");
+  }
+
+  // Bytes read ahead and not consumed yet; `skip` them once used.
+  virtual auto buffered() const -> std::span<const char> { return {}; }
+
+  // Moves up to `size` bytes at `tell()` into `out` inside the kernel. Only
+  // once `buffered()` is empty. Returns how many, 0 if it can't.
+  virtual auto send(int out, uint64_t size) -> uint64_t {
+    (void)out, (void)size;
+    return 0;
+  }
+
+  // Underlying descriptor, -1 if there is none.
+  virtual auto fd() const -> int { return -1; }
+};
+
+// Buffered sink over a descriptor: a file, pipe or socket. Small writes are
+// gathered in the buffer; a write that doesn't fit goes out together with the
+// buffered bytes in one `writev`, so a header, its path and a big payload
+// cost a single syscall.
+class fd_sink : public sink {
+  sys::fd fd_;
+  fs::path path_;  // for errors
+  std::unique_ptr<char, detail::aligned_free> buf_;
+  size_t used_ = 0;
+  bool seekable_ = false;
+
+  void drain() {
+    if (used_ > 0 && !sys::write_all(fd_.get(), buf_.get(), used_))
+      sys::fail("write", path_);
+    used_ = 0;
+  }
+
+ public:
+  explicit fd_sink(sys::fd fd, fs::path path = {})
+      : fd_(std::move(fd)), path_(std::move(path)), buf_(detail::aligned_buffer()) {
+    // positioned writes land at the end with O_APPEND, e.g. `bar a - x >> file`
+    struct stat st;
+    seekable_ = ::fstat(fd_.get(), &st) == 0 && S_ISREG(st.st_mode) &&
+                !(::fcntl(fd_.get(), F_GETFL) & O_APPEND);
+  }
+
+  ~fd_sink() override {
+    if (used_ > 0)
+      sys::write_all(fd_.get(), buf_.get(), used_);  // best effort, errors surface in flush
+  }
+
+  void write(const void* data, size_t size) override {
+    if (size <= detail::BUF_SIZE - used_) {
+      std::memcpy(buf_.get() + used_, data, size);
+      used_ += size;
+      return;
+    }
+    if (size < detail::BUF_SIZE) {
+      drain();
+      std::memcpy(buf_.get(), data, size);
+      used_ = size;
+      return;
+    }
+    std::array<iovec, 2> parts = {{{buf_.get(), used_}, {const_cast<void*>(data), size}}};
+    if (!sys::writev_all(fd_.get(), parts))
+      sys::fail("writev", path_);
+    used_ = 0;
+  }
+
+  void flush() override { drain(); }
+
+  bool seekable() const override { return seekable_; }
+
+  void patch(uint64_t offset, const void* data, size_t size) override {
+    drain();
+    if (!sys::pwrite_all(fd_.get(), data, size, offset))
+      sys::fail("pwrite", path_);
+  }
+
+  void reserve(uint64_t size) override {
+    drain();
+    if (::lseek(fd_.get(), static_cast<off_t>(size), SEEK_CUR) < 0)
+      sys::fail("lseek", path_);
+  }
+
+  auto receive(int in, off_t* in_off, uint64_t size) -> uint64_t override {
+    drain();
+    return sys::transfer(in, in_off, fd_.get(), size);
+  }
+
+  auto fd() const -> int override { return fd_.get(); }
+};
+
+// Buffered source over a descriptor. Regular files are read with `pread` at
+// a tracked offset, so skips are free and the descriptor offset is never
+// shared state; pipes are read in order and skipped by reading.
+class fd_source : public source {
+  sys::fd fd_;
+  fs::path path_;  // for errors
+  std::unique_ptr<char, detail::aligned_free> buf_;
+  size_t begin_ = 0, end_ = 0;  // unread window of `buf_`
+  uint64_t pos_ = 0;
+  uint64_t size_ = 0;
+  bool seekable_ = false;
+
+  auto raw_read(char* data, size_t size) -> size_t {
+    while (true) {
+      const auto n = seekable_ ? ::pread(fd_.get(), data, size, static_cast<off_t>(pos_))
+                               : ::read(fd_.get(), data, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        sys::fail("read", path_);
+      return static_cast<size_t>(n);
+    }
+  }
+
+  auto fill() -> bool {
+    begin_ = 0;
+    end_ = raw_read(buf_.get(), detail::BUF_SIZE);
+    return end_ > 0;
+  }
+
+ public:
+  explicit fd_source(sys::fd fd, fs::path path = {})
+      : fd_(std::move(fd)), path_(std::move(path)), buf_(detail::aligned_buffer()) {
+    struct stat st;
+    if (::fstat(fd_.get(), &st) == 0 && S_ISREG(st.st_mode)) {
+      seekable_ = true;
+      size_ = static_cast<uint64_t>(st.st_size);
+      if (const auto at = ::lseek(fd_.get(), 0, SEEK_CUR); at > 0)
+        pos_ = static_cast<uint64_t>(at);
+    }
+  }
+
+  auto read(void* data, size_t size) -> size_t override {
+    auto* out = static_cast<char*>(data);
+    size_t done = 0;
+    while (done < size) {
+      if (begin_ == end_) {
+        if (size - done >= detail::BUF_SIZE) {
+          // large reads go straight into the caller's memory
+          const auto n = raw_read(out + done, size - done);
+          if (n == 0)
+            break;
+          pos_ += n;
+          done += n;
+          continue;
+        }
+        if (!fill())
+          break;
+      }
+      const auto n = std::min(size - done, end_ - begin_);
+      std::memcpy(out + done, buf_.get() + begin_, n);
+      begin_ += n;
+      pos_ += n;
+      done += n;
+    }
+    return done;
+  }
+
+  void skip(uint64_t size) override {
+    const auto here = std::min<uint64_t>(size, end_ - begin_);
+    begin_ += here;
+    pos_ += here;
+    size -= here;
+    if (seekable_) {
+      pos_ += size;
+      return;
+    }
+    while (size > 0 && fill()) {
+      const auto n = std::min<uint64_t>(size, end_);
+      begin_ = n;
+      pos_ += n;
+      size -= n;
+    }
+  }
+
+  auto tell() const -> uint64_t override { return pos_; }
+
+  bool seekable() const override { return seekable_; }
+
+  void seek(uint64_t offset) override {
+    if (!seekable_)
+      source::seek(offset);
+    const auto start = pos_ - begin_;  // file offset of `buf_`
+    if (offset >= start && offset <= start + end_) {
+      begin_ = offset - start;
+    } else {
+      begin_ = end_ = 0;
+    }
+    pos_ = offset;
+  }
+
+  auto size() const -> uint64_t override { return size_; }
+
+  auto pread(void* data, size_t size, uint64_t offset) -> size_t override {
+    return sys::pread_all(fd_.get(), data, size, offset);
+  }
+
+  auto buffered() const -> std::span<const char> override {
+    return {buf_.get() + begin_, end_ - begin_};
+  }
+
+  auto send(int out, uint64_t size) -> uint64_t override {
+    if (begin_ != end_)
+      return 0;
+    auto at = static_cast<off_t>(pos_);
+    const auto n = sys::transfer(fd_.get(), seekable_ ? &at : nullptr, out, size);
+    pos_ += n;
+    return n;
+  }
+
+  auto fd() const -> int override { return fd_.get(); }
+};
+
+// Sink collecting the archive in memory.
+class memory_sink : public sink {
+  std::vector<char> data_;
+
+ public:
+  void write(const void* data, size_t size) override {
+    const auto* at = static_cast<const char*>(data);
+    data_.insert(data_.end(), at, at + size);
+  }
+
+  bool seekable() const override { return true; }
+
+  void patch(uint64_t offset, const void* data, size_t size) override {
+    std::memcpy(data_.data() + offset, data, size);
+  }
+
+  auto& data() const { return data_; }
+};
+
+// Source over bytes already in memory, e.g. a mapping; they must outlive it.
+class memory_source : public source {
+  std::span<const char> data_;
+  size_t pos_ = 0;
+
+ public:
+  explicit memory_source(std::span<const char> data) : data_(data) {}
+
+  auto read(void* data, size_t size) -> size_t override {
+    const auto n = std::min(size, data_.size() - pos_);
+    std::memcpy(data, data_.data() + pos_, n);
+    pos_ += n;
+    return n;
+  }
+
+  void skip(uint64_t size) override { pos_ += std::min<uint64_t>(size, data_.size() - pos_); }
+
+  auto tell() const -> uint64_t override { return pos_; }
+
+  bool seekable() const override { return true; }
+
+  void seek(uint64_t offset) override { pos_ = std::min<uint64_t>(offset, data_.size()); }
+
+  auto size() const -> uint64_t override { return data_.size(); }
+
+  auto pread(void* data, size_t size, uint64_t offset) -> size_t override {
+    if (offset >= data_.size())
+      return 0;
+    const auto n = std::min<uint64_t>(size, data_.size() - offset);
+    std::memcpy(data, data_.data() + offset, n);
+    return n;
+  }
+
+  auto buffered() const -> std::span<const char> override { return data_.subspan(pos_); }
+};
+
+// Source over a pipe or socket with a reader thread. Two buffers take turns:
+// while one is decoded the next one fills, so the upstream isn't stalled by
+// the disk work of an extraction. Nothing moves in the kernel here.
+class pipe_source : public source {
+  struct slot {
+    std::unique_ptr<char, detail::aligned_free> data = detail::aligned_buffer();
+    size_t size = 0;    // 0 once full marks the end
+    bool full = false;  // filled by the reader, not consumed yet
+  };
+
+  sys::fd fd_;
+  fs::path path_;  // for errors
+  sys::fd wake_[2];
+  std::array<slot, 2> slots_;
+  size_t current_ = 0;  // slot being consumed
+  size_t begin_ = 0;
+  bool have_ = false;  // whether `current_` was handed over by the reader
+  uint64_t pos_ = 0;
+
+  bool stop_ = false;
+  std::exception_ptr error_;
+  std::mutex mutex_;
+  std::condition_variable ready_;  // slot filled, consumed or stopping
+  std::jthread reader_;
+
+  // Blocks until the pipe has data, 0 at its end or once stopping.
+  auto fill(char* data, size_t size) -> size_t {
+    while (true) {
+      pollfd fds[2] = {{fd_.get(), POLLIN, 0}, {wake_[0].get(), POLLIN, 0}};
+      if (::poll(fds, 2, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        sys::fail("poll", path_);
+      }
+      if (fds[1].revents)
+        return 0;
+      const auto n = ::read(fd_.get(), data, size);
+      if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      if (n < 0)
+        sys::fail("read", path_);
+      return static_cast<size_t>(n);
+    }
+  }
+
+  void run() {
+    bool end = false;
+    for (size_t i = 0;; i ^= 1) {
+      auto& s = slots_[i];
+      {
+        std::unique_lock lock(mutex_);
+        ready_.wait(lock, [&] { return stop_ || !s.full; });
+        if (stop_)
+          return;
+      }
+
+      size_t n = 0;
+      try {
+        while (!end && n < detail::BUF_SIZE) {
+          const auto got = fill(s.data.get() + n, detail::BUF_SIZE - n);
+          end = got == 0;
+          n += got;
+        }
+      } catch (...) {
+        std::lock_guard lock(mutex_);
+        error_ = std::current_exception();
+        end = true;
+      }
+
+      {
+        std::lock_guard lock(mutex_);
+        s.size = n;
+        s.full = true;
+      }
+      ready_.notify_all();
+      if (n == 0)
+        return;
+    }
+  }
+
+  // Makes the consumed slot hold unread bytes, false at the end.
+  auto acquire() -> bool {
+    if (have_) {
+      auto& s = slots_[current_];
+      if (s.size == 0)
+        return false;
+      if (begin_ < s.size)
+        return true;
+      {
+        std::lock_guard lock(mutex_);
+        s.full = false;
+      }
+      ready_.notify_all();
+      current_ ^= 1;
+      begin_ = 0;
+    }
+
+    auto& s = slots_[current_];
+    std::unique_lock lock(mutex_);
+    ready_.wait(lock, [&] { return s.full; });
+    have_ = true;
+    if (s.size == 0 && error_)
+      std::rethrow_exception(error_);
+    return s.size > 0;
+  }
+
+ public:
+  explicit pipe_source(sys::fd fd, fs::path path = {})
+      : fd_(std::move(fd)), path_(std::move(path)) {
+    int wake[2];
+    if (::pipe2(wake, O_CLOEXEC) != 0)
+      sys::fail("pipe", path_);
+    wake_[0] = sys::fd(wake[0]);
+    wake_[1] = sys::fd(wake[1]);
+    reader_ = std::jthread([this] { run(); });
+  }
+
+  ~pipe_source() override {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    ready_.notify_all();
+    const char byte = 0;
+    sys::write_all(wake_[1].get(), &byte, 1);
+    reader_.join();
+  }
+
+  auto read(void* data, size_t size) -> size_t override {
+    auto* out = static_cast<char*>(data);
+    size_t done = 0;
+    while (done < size && acquire()) {
+      const auto& s = slots_[current_];
+      const auto n = std::min(size - done, s.size - begin_);
+      std::memcpy(out + done, s.data.get() + begin_, n);
+      begin_ += n;
+      pos_ += n;
+      done += n;
+    }
+    return done;
+  }
+
+  void skip(uint64_t size) override {
+    while (size > 0 && acquire()) {
+      const auto n = std::min<uint64_t>(size, slots_[current_].size - begin_);
+      begin_ += n;
+      pos_ += n;
+      size -= n;
+    }
+  }
+
+  auto tell() const -> uint64_t override { return pos_; }
+
+  auto buffered() const -> std::span<const char> override {
+    if (!have_)
+      return {};
+    const auto& s = slots_[current_];
+    return {s.data.get() + begin_, s.size - begin_};
+  }
+};
+
+// Sink into a pipe or socket with a writer thread. Two buffers take turns:
+// one fills while the other drains, so archiving goes on while the downstream
+// is slow. Errors of the writer surface on a later write or `flush`.
+class pipe_sink : public sink {
+  struct slot {
+    std::unique_ptr<char, detail::aligned_free> data = detail::aligned_buffer();
+    size_t size = 0;
+    bool full = false;  // handed to the writer, not written yet
+  };
+
+  sys::fd fd_;
+  fs::path path_;  // for errors
+  std::array<slot, 2> slots_;
+  size_t current_ = 0;  // slot being filled
+
+  bool stop_ = false;
+  std::exception_ptr error_;
+  std::mutex mutex_;
+  std::condition_variable ready_;  // slot handed over, written or stopping
+  std::jthread writer_;
+
+  void run() {
+    bool failed = false;  // the rest is dropped then, the error is rethrown instead
+    for (size_t i = 0;; i ^= 1) {
+      auto& s = slots_[i];
+      {
+        std::unique_lock lock(mutex_);
+        ready_.wait(lock, [&] { return stop_ || s.full; });
+        if (!s.full)
+          return;
+      }
+      std::exception_ptr error;
+      if (!failed && !sys::write_all(fd_.get(), s.data.get(), s.size)) {
+        try {
+          sys::fail("write", path_);
+        } catch (...) {
+          error = std::current_exception();
+          failed = true;
+        }
+      }
+      {
+        std::lock_guard lock(mutex_);
+        if (error)
+          error_ = error;
+        s.size = 0;
+        s.full = false;
+      }
+      ready_.notify_all();
+    }
+  }
+
+  // Waits until `pred` holds, then rethrows a failure of the writer.
+  template <typename P>
+  void wait(P&& pred) {
+    std::unique_lock lock(mutex_);
+    ready_.wait(lock, pred);
+    if (error_)
+      std::rethrow_exception(std::exchange(error_, nullptr));
+  }
+
+  // Passes the filled slot to the writer and waits for the other one.
+  void hand_off() {
+    {
+      std::lock_guard lock(mutex_);
+      slots_[current_].full = true;
+    }
+    ready_.notify_all();
+    current_ ^= 1;
+    wait([&] { return !slots_[current_].full; });
+  }
+
+ public:
+  explicit pipe_sink(sys::fd fd, fs::path path = {})
+      : fd_(std::move(fd)), path_(std::move(path)) {
+    writer_ = std::jthread([this] { run(); });
+  }
+
+  ~pipe_sink() override {
+    try {
+      flush();
+    } catch (...) {
+      // best effort, errors surface in flush
+    }
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    ready_.notify_all();
+    writer_.join();
+  }
+
+  void write(const void* data, size_t size) override {
+    const auto* in = static_cast<const char*>(data);
+    while (size > 0) {
+      auto& s = slots_[current_];
+      const auto n = std::min(size, detail::BUF_SIZE - s.size);
+      std::memcpy(s.data.get() + s.size, in, n);
+      s.size += n;
+      in += n;
+      size -= n;
+      if (s.size == detail::BUF_SIZE)
+        hand_off();
+    }
+  }
+
+  void flush() override {
+    if (slots_[current_].size > 0)
+      hand_off();
+    wait([&] { return !slots_[0].full && !slots_[1].full; });
+  }
+
+  auto receive(int in, off_t* in_off, uint64_t size) -> uint64_t override {
+    flush();
+    return sys::transfer(in, in_off, fd_.get(), size);
+  }
+
+  auto fd() const -> int override { return fd_.get(); }
+};
+
+// Source for `fd`: a regular file is read in place, anything else through a
+// reader thread.
+inline auto open_source(sys::fd fd, fs::path path = {}) -> std::unique_ptr<source> {
+  struct stat st;
+  if (::fstat(fd.get(), &st) == 0 && S_ISREG(st.st_mode))
+    return std::make_unique<fd_source>(std::move(fd), std::move(path));
+  return std::make_unique<pipe_source>(std::move(fd), std::move(path));
+}
+
+// Sink for `fd`: a regular file is written directly, anything else through a
+// writer thread.
+inline auto open_sink(sys::fd fd, fs::path path = {}) -> std::unique_ptr<sink> {
+  struct stat st;
+  if (::fstat(fd.get(), &st) == 0 && S_ISREG(st.st_mode))
+    return std::make_unique<fd_sink>(std::move(fd), std::move(path));
+  return std::make_unique<pipe_sink>(std::move(fd), std::move(path));
+}
+
+}  // namespace bar::io
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+#include "entry.hxx"
+#include "header.hxx"
+
+namespace bar {
+
+// Entries of an archive as a table of columns, for bulk reads. Every path
+// lives in one arena, so adding a row allocates nothing once the columns
+// have grown, and a pass over a few columns streams through just those.
+// Views returned by `path` last until the next `add` or `clear`.
+class listing {
+  std::vector<entry_type> types_;
+  std::vector<uint8_t> flags_;
+  std::vector<uint32_t> modes_;
+  std::vector<int64_t> mtimes_;
+  std::vector<uint64_t> sizes_;
+  std::vector<uint64_t> raws_;
+  std::vector<uint64_t> offsets_;
+  std::vector<uint64_t> ends_;  // of each path in `arena_`
+  std::vector<char> arena_;
+
+ public:
+  // Adds an entry whose file has `raw` bytes, see `codec::raw`.
+  void add(const header_t& header, uint64_t offset, std::string_view path, uint64_t raw) {
+    // copies, `header_t` is packed and its fields can't be bound to references
+    types_.push_back(entry_type{header.type});
+    flags_.push_back(uint8_t{header.flags});
+    modes_.push_back(uint32_t{header.mode});
+    mtimes_.push_back(int64_t{header.mtime});
+    sizes_.push_back(uint64_t{header.data});
+    raws_.push_back(raw);
+    offsets_.push_back(offset);
+    arena_.insert(arena_.end(), path.begin(), path.end());
+    ends_.push_back(arena_.size());
+  }
+
+  // Empties the table but keeps its memory for the next batch.
+  void clear() {
+    types_.clear();
+    flags_.clear();
+    modes_.clear();
+    mtimes_.clear();
+    sizes_.clear();
+    raws_.clear();
+    offsets_.clear();
+    ends_.clear();
+    arena_.clear();
+  }
+
+  auto size() const { return types_.size(); }
+  bool empty() const { return types_.empty(); }
+
+  auto types() const -> std::span<const entry_type> { return types_; }
+  auto sizes() const -> std::span<const uint64_t> { return sizes_; }
+  auto offsets() const -> std::span<const uint64_t> { return offsets_; }
+
+  auto type(size_t i) const { return types_[i]; }
+  auto payload(size_t i) const { return sizes_[i]; }  // stored bytes, `header_t::data`
+  auto raw(size_t i) const { return raws_[i]; }       // bytes of the file
+  auto offset(size_t i) const { return offsets_[i]; }
+  auto mtime(size_t i) const { return mtimes_[i]; }
+  auto perms(size_t i) const { return static_cast<fs::perms>(modes_[i]) & fs::perms::mask; }
+
+  auto path(size_t i) const -> std::string_view {
+    const auto begin = i ? ends_[i - 1] : 0;
+    return {arena_.data() + begin, ends_[i] - begin};
+  }
+
+  auto header(size_t i) const -> header_t {
+    header_t header{};
+    header.type = types_[i];
+    header.flags = flags_[i];
+    header.mtime = mtimes_[i];
+    header.path = static_cast<uint16_t>(path(i).size());
+    header.mode = modes_[i];
+    header.data = sizes_[i];
+    return header;
+  }
+
+  // Row `i` as an entry, with its own copy of the path.
+  auto to_entry(size_t i) const -> entry { return {fs::path(path(i)), header(i)}; }
+};
+
+}  // namespace bar
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Built-in LZ77 codec producing the LZ4 block format: a token byte with
+// literal and match lengths, the literals, then a 16 bit match offset.
+// Single pass with a 4 byte hash table, no entropy stage, so both directions
+// run at memory speed.
+namespace bar::lz {
+
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t LAST_LITERALS = 5;   // the block always ends with literals
+constexpr size_t MF_LIMIT = 12;       // no match starts this close to the end
+constexpr size_t MAX_OFFSET = 65535;
+constexpr int HASH_LOG = 16;
+
+// Worst case size of `compress` output for `size` input bytes.
+constexpr auto bound(size_t size) -> size_t { return size + size / 255 + 16; }
+
+namespace detail {
+
+inline auto read32(const uint8_t* at) -> uint32_t {
+  uint32_t val;
+  std::memcpy(&val, at, sizeof(val));
+  return val;
+}
+
+inline auto read64(const uint8_t* at) -> uint64_t {
+  uint64_t val;
+  std::memcpy(&val, at, sizeof(val));
+  return val;
+}
+
+inline auto hash(uint32_t seq, int log) -> uint32_t {
+  return (seq * 2654435761u) >> (32 - log);
+}
+
+// Length of the common prefix of `at` and `ref`, not reading past `limit`.
+inline auto count(const uint8_t* at, const uint8_t* ref, const uint8_t* limit) -> size_t {
+  const auto* start = at;
+  if constexpr (std::endian::native == std::endian::little) {
+    while (at + 8 <= limit) {
+      if (auto diff = read64(at) ^ read64(ref)) {
+        return (at - start) + std::countr_zero(diff) / 8;
+      }
+      at += 8;
+      ref += 8;
+    }
+  }
+  while (at < limit && *at == *ref) {
+    at++;
+    ref++;
+  }
+  return at - start;
+}
+
+inline auto put_length(uint8_t* out, size_t len) -> uint8_t* {
+  for (; len >= 255; len -= 255) {
+    *out++ = 255;
+  }
+  *out++ = static_cast<uint8_t>(len);
+  return out;
+}
+
+}  // namespace detail
+
+// Compresses `size` bytes of `src` into `dst`, which holds at least
+// `bound(size)` bytes. Returns the compressed size.
+inline auto compress(const void* src, size_t size, void* dst) -> size_t {
+  using namespace detail;
+
+  // small inputs don't pay for clearing the whole table
+  const int log = size < (1 << 12) ? 10 : size < (1 << 16) ? 13 : HASH_LOG;
+  thread_local std::vector<uint32_t> table(1 << HASH_LOG);
+  std::fill_n(table.begin(), 1 << log, 0);
+
+  const auto* in = static_cast<const uint8_t*>(src);
+  const auto* end = in + size;
+  const auto* ip = in;
+  const auto* anchor = in;
+  auto* op = static_cast<uint8_t*>(dst);
+
+  auto emit = [&](size_t literals, size_t offset, size_t match) {
+    auto* token = op++;
+    *token = static_cast<uint8_t>(std::min<size_t>(literals, 15) << 4);
+    if (literals >= 15)
+      op = put_length(op, literals - 15);
+    if (literals)
+      std::memcpy(op, anchor, literals);
+    op += literals;
+
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+
+    *token |= static_cast<uint8_t>(std::min<size_t>(match, 15));
+    if (match >= 15)
+      op = put_length(op, match - 15);
+  };
+
+  if (size > MF_LIMIT) {
+    const auto* mf_limit = end - MF_LIMIT;
+    const auto* match_limit = end - LAST_LITERALS;
+
+    for (size_t misses = 0; ip < mf_limit;) {
+      const auto h = hash(read32(ip), log);
+      const auto* ref = in + table[h];
+      table[h] = static_cast<uint32_t>(ip - in);
+
+      if (ref >= ip || static_cast<size_t>(ip - ref) > MAX_OFFSET ||
+          read32(ref) != read32(ip)) {
+        // step faster through incompressible data
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const auto len = count(ip + MIN_MATCH, ref + MIN_MATCH, match_limit);
+      emit(ip - anchor, ip - ref, len);
+
+      ip += MIN_MATCH + len;
+      anchor = ip;
+      if (ip < mf_limit)
+        table[hash(read32(ip - 2), log)] = static_cast<uint32_t>(ip - 2 - in);
+    }
+  }
+
+  const auto literals = static_cast<size_t>(end - anchor);
+  *op = static_cast<uint8_t>(std::min<size_t>(literals, 15) << 4);
+  op++;
+  if (literals >= 15)
+    op = put_length(op, literals - 15);
+  if (literals)
+    std::memcpy(op, anchor, literals);
+  op += literals;
+
+  return op - static_cast<uint8_t*>(dst);
+}
+
+// Decompresses `size` bytes of `src` into `dst` of `cap` bytes. Returns the
+// decompressed size, or `-1` for malformed input; never writes out of bounds.
+inline auto decompress(const void* src, size_t size, void* dst, size_t cap) -> ptrdiff_t {
+  const auto* ip = static_cast<const uint8_t*>(src);
+  const auto* end = ip + size;
+  auto* const out = static_cast<uint8_t*>(dst);
+  auto* op = out;
+  auto* const out_end = out + cap;
+
+  auto length = [&](size_t len) -> ptrdiff_t {
+    if (len != 15)
+      return static_cast<ptrdiff_t>(len);
+    uint8_t byte;
+    do {
+      if (ip >= end)
+        return -1;
+      byte = *ip++;
+      len += byte;
+    } while (byte == 255);
+    return static_cast<ptrdiff_t>(len);
+  };
+
+  while (ip < end) {
+    const auto token = *ip++;
+
+    const auto literals = length(token >> 4);
+    if (literals < 0 || literals > end - ip || literals > out_end - op)
+      return -1;
+    if (literals <= 16 && end - ip >= 16 && out_end - op >= 16) {
+      std::memcpy(op, ip, 16);  // fixed size copies are a couple of moves
+    } else if (literals) {
+      std::memcpy(op, ip, literals);
+    }
+    op += literals;
+    ip += literals;
+
+    if (ip == end)
+      break;  // the last sequence has no match
+
+    if (end - ip < 2)
+      return -1;
+    const size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > static_cast<size_t>(op - out))
+      return -1;
+
+    auto match = length(token & 15);
+    if (match < 0)
+      return -1;
+    match += MIN_MATCH;
+    if (match > out_end - op)
+      return -1;
+
+    const auto* ref = op - offset;
+    if (offset >= 8 && out_end - op >= match + 8) {
+      // 8 byte steps never read what the same step writes
+      auto* stop = op + match;
+      for (; op < stop; op += 8, ref += 8) {
+        std::memcpy(op, ref, 8);
+      }
+      op = stop;
+    } else {
+      // overlapping copy repeats the last `offset` bytes
+      for (auto* stop = op + match; op < stop;) {
+        *op++ = *ref++;
+      }
+    }
+  }
+  return op - out;
+}
+
+}  // namespace bar::lz
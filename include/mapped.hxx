@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include "codec.hxx"
+#include "crc.hxx"
+#include "entry.hxx"
+#include "index.hxx"
+#include "sys.hxx"
+
+#include <sys/mman.h>
+
+namespace bar {
+
+enum struct access { sequential, random };
+
+// Archive reader over a read-only mapping of the whole file. Entries come
+// with a view of their payload, so nothing is copied and no syscall is made
+// per read. Views live as long as the `mapped` itself.
+class mapped {
+ public:
+  struct item {
+    bar::entry entry;
+    std::span<const std::byte> data;
+    std::optional<uint32_t> crc;  // stored checksum of `data`
+
+    // Whether `data` matches its stored checksum, trivially without one.
+    bool intact() const { return !crc || bar::crc::crc32c(0, data.data(), data.size()) == *crc; }
+  };
+
+ private:
+  const std::byte* base_ = nullptr;
+  size_t size_ = 0;
+  size_t pos_ = sizeof(BAR);
+  bar::codec codec_{format::v1};
+  std::optional<bar::index> index_;
+
+  auto slice(uint64_t offset, uint64_t size) const -> std::optional<std::span<const std::byte>> {
+    if (offset > size_ || size > size_ - offset)
+      return std::nullopt;
+    return std::span(base_ + offset, size);
+  }
+
+  // Payload of `header` at `offset` with its checksum, nullopt if truncated.
+  auto payload(const header_t& header, uint64_t offset) const -> std::optional<item> {
+    auto data = slice(offset, header.data);
+    if (!data)
+      return std::nullopt;
+
+    std::optional<uint32_t> crc;
+    if (header.flags & flag::crc) {
+      auto tail = slice(offset + header.data, sizeof(checksum::repr));
+      if (!tail)
+        return std::nullopt;
+      checksum::repr buf;
+      std::memcpy(&buf, tail->data(), sizeof(buf));
+      crc = sys::read_crc(&buf);
+    }
+    return item{entry({}, header), *data, crc};
+  }
+
+  void load_index() {
+    trailer::repr tail;
+    if (size_ < sizeof(tail))
+      return;
+    std::memcpy(&tail, base_ + size_ - sizeof(tail), sizeof(tail));
+
+    if (auto trailer = bar::index::locate(tail, size_, codec_.format())) {
+      const auto* at = reinterpret_cast<const char*>(base_) + trailer->index;
+      index_ = bar::index::decode(std::span(at, size_ - trailer->index), *trailer,
+                                  codec_.format());
+    }
+  }
+
+ public:
+  explicit mapped(const fs::path& path, access hint = access::sequential) {
+    auto file = sys::open(path, O_RDONLY);
+
+    struct stat st;
+    if (::fstat(file.get(), &st) != 0)
+      sys::fail("fstat", path);
+    size_ = static_cast<size_t>(st.st_size);
+
+    if (size_ < sizeof(BAR))
+      throw std::runtime_error("invalid bar archive: bad magic");
+
+    void* map = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, file.get(), 0);
+    if (map == MAP_FAILED)
+      sys::fail("mmap", path);
+    base_ = static_cast<const std::byte*>(map);
+
+    std::array<uint8_t, 4> magic;
+    std::memcpy(magic.data(), base_, magic.size());
+    const auto format = format_of(magic);
+    if (!format) {
+      ::munmap(map, size_);
+      throw std::runtime_error("invalid bar archive: bad magic");
+    }
+    codec_ = bar::codec(*format);
+
+    advise(hint);
+    load_index();
+  }
+
+  mapped(const mapped&) = delete;
+  auto operator=(const mapped&) -> mapped& = delete;
+
+  ~mapped() { ::munmap(const_cast<std::byte*>(base_), size_); }
+
+  // Tells the kernel how the payloads are going to be read.
+  void advise(access hint) const {
+    ::madvise(const_cast<std::byte*>(base_), size_,
+              hint == access::sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+  }
+
+  auto index() const -> const bar::index* { return index_ ? &*index_ : nullptr; }
+
+  auto bytes() const { return std::span(base_, size_); }
+
+  // Next entry in archive order, nullopt at the end or on a truncated entry.
+  std::optional<item> next() {
+    while (true) {
+      auto at = pos_;
+      const auto header = codec_.get([&](void* data, size_t size) {
+        const auto bytes = slice(at, size);
+        if (!bytes)
+          return false;
+        std::memcpy(data, bytes->data(), size);
+        at += size;
+        return true;
+      });
+      if (!header)
+        return std::nullopt;
+      auto it = payload(*header, at);
+      if (!it)
+        return std::nullopt;
+      pos_ = at + it->entry.stored_size();
+
+      if (header->type == entry_type::index || header->type == entry_type::pad)
+        continue;
+
+      it->entry = entry(fs::path(codec_.path()), *header);
+      return it;
+    }
+  }
+
+  // Whether `next` went through the whole file; false once it stopped at a
+  // truncated entry or before trailing garbage.
+  bool at_end() const { return pos_ == size_; }
+
+  // Looks `path` up in the index and prefetches its payload.
+  std::optional<item> find(std::string_view path) const {
+    const auto* rec = index_ ? index_->find(path) : nullptr;
+    if (!rec)
+      return std::nullopt;
+    return at(*rec);
+  }
+
+  std::optional<item> at(const bar::index::record& rec) const {
+    auto it = payload(rec.header, rec.offset);
+    if (!it)
+      return std::nullopt;
+    if (!it->data.empty()) {
+      // madvise wants a page aligned start
+      const auto page = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+      const auto from = rec.offset & ~(page - 1);
+      ::madvise(const_cast<std::byte*>(base_) + from, rec.offset + rec.header.data - from,
+                MADV_WILLNEED);
+    }
+    it->entry = rec.to_entry();
+    return it;
+  }
+};
+
+}  // namespace bar
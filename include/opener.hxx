@@ -1,68 +1,507 @@
 #pragma once
 
 #include <cstdint>
-#include <istream>
 #include <cstring>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#include "codec.hxx"
+#include "crc.hxx"
 #include "entry.hxx"
+#include "index.hxx"
+#include "io.hxx"
+#include "listing.hxx"
+#include "lz.hxx"
+#include "stats.hxx"
 #include "sys.hxx"
+#include "target.hxx"
 
 namespace bar {
 
 class opener {
-  std::istream& input_;
+  io::source& input_;
+  bar::codec codec_{format::v1};
+  std::optional<bar::index> index_;
+  size_t listed_ = 0;  // index records passed to `list`
+  bar::stats* stats_;
+
+  // Literal chunks of an unseekable input, kept for later references as the
+  // input can't be read again: archive offset -> offset in `spill_`.
+  sys::fd spill_;
+  std::unordered_map<uint64_t, uint64_t> spilled_;
+  uint64_t spill_size_ = 0;
+
+  // Running checksum of the payload being extracted, checked once it is
+  // written out so that it is read only once.
+  std::optional<uint32_t> crc_;
+
+  constexpr static size_t BUF_SIZE = 256 * 1024;
+
+  // Looks for the trailer at the end of a seekable archive and loads the
+  // index it points to with one read. Archives without one are scanned.
+  void load_index() {
+    if (!input_.seekable())
+      return;
+    const auto size = input_.size();
+
+    trailer::repr tail;
+    if (size < sizeof(tail) ||
+        input_.pread(&tail, sizeof(tail), size - sizeof(tail)) != sizeof(tail)) {
+      return;
+    }
+    auto trailer = bar::index::locate(tail, size, format());
+    if (!trailer) {
+      return;
+    }
+
+    std::vector<char> raw(size - trailer->index);
+    if (input_.pread(raw.data(), raw.size(), trailer->index) == raw.size()) {
+      index_ = bar::index::decode(raw, *trailer, format());
+    }
+  }
+
+  // Reads up to `size` bytes, short only at the end, into the running
+  // checksum if there is one.
+  auto take(void* data, size_t size) -> size_t {
+    const auto n = input_.read(data, size);
+    if (crc_)
+      crc_ = crc::crc32c(*crc_, data, n);
+    return n;
+  }
+
+  // Reads exactly `size` bytes, false if the archive ends first.
+  auto read(void* data, size_t size) -> bool { return take(data, size) == size; }
+
+  // File size of the entry `header` whose payload is at `offset`, `raw` as
+  // the format stores it. v1 only has the stored size of transformed
+  // payloads, so it is read off their frames; an unseekable input reads on
+  // to them from `tell()`.
+  auto raw_size(const header_t& header, uint64_t offset, uint64_t raw) -> uint64_t {
+    if (format() == format::v2)
+      return raw;
+    return sys::raw_size(header, offset, [&](void* data, size_t size, uint64_t at) {
+      if (input_.seekable())
+        return input_.pread(data, size, at);
+      input_.skip(at - tell());
+      return input_.read(data, size);
+    });
+  }
 
  public:
-  explicit opener(std::istream& in) : input_(in) {
+  explicit opener(io::source& in, bar::stats* stats = nullptr) : input_(in), stats_(stats) {
     std::array<uint8_t, 4> magic;
-    input_.read(reinterpret_cast<char*>(&magic), sizeof(magic));
-    if (input_.gcount() != sizeof(magic) || magic != BAR) {
+    const auto format = read(&magic, sizeof(magic)) ? format_of(magic) : std::nullopt;
+    if (!format) {
       throw std::runtime_error("invalid bar archive: bad magic");
     }
+    codec_ = bar::codec(*format);
+    load_index();
   }
 
+  auto format() const -> bar::format { return codec_.format(); }
+
+  // Central index of the archive, if it has one.
+  auto index() const -> const bar::index* { return index_ ? &*index_ : nullptr; }
+
   std::optional<entry> next_entry() {
-    header::repr buf;
-    if (!input_.read(reinterpret_cast<char*>(&buf), sizeof(buf))) {
+    stats::timer timer(stats_, stats::phase::header);
+    const auto header = next_header();
+    if (!header)
       return std::nullopt;
+    return bar::entry(fs::path(codec_.path()), *header);
+  }
+
+  // Appends up to `limit` entries to `out`, as `bar l` shows them: the live
+  // records of the index, or without one the entries that follow in archive
+  // order, tombstones aside. Returns how many, 0 once everything is listed.
+  // Nothing is allocated per entry.
+  auto list(listing& out, size_t limit = std::numeric_limits<size_t>::max()) -> size_t {
+    size_t n = 0;
+    if (index_) {
+      const auto& records = index_->records();
+      for (; listed_ < records.size() && n < limit; ++listed_) {
+        const auto& rec = records[listed_];
+        if (!index_->is_live(rec))
+          continue;
+        out.add(rec.header, rec.offset, rec.path, raw_size(rec.header, rec.offset, rec.raw));
+        n++;
+      }
+      return n;
     }
-    header_t header = sys::read_header(&buf);
 
-    std::string path(header.path, '\0');
-    if (!input_.read(path.data(), path.size())) {
-      return std::nullopt;
+    while (n < limit) {
+      const auto header = next_header();
+      if (!header)
+        break;
+      const auto at = tell();
+      if (header->type != entry_type::del) {
+        out.add(*header, at, codec_.path(), raw_size(*header, at, codec_.raw()));
+        n++;
+      }
+      // plain bytes to a listing, chunks aren't kept for later references
+      const auto crc = header->flags & flag::crc ? sizeof(checksum::repr) : 0;
+      input_.skip(at + header->data + crc - tell());
     }
-    return entry(fs::path(path), header);
+    return n;
   }
 
-  void unpack(const entry& entry, const fs::path& dest_dir) {
-    auto full_path = dest_dir / entry.path();
+  // Builds the index of an archive without one by walking all its headers,
+  // then rewinds to the first entry.
+  auto scan() -> bar::index {
+    std::vector<char> raw;
+    uint64_t count = 0;
+    bar::codec records(format());
+
+    rewind();
+    while (const auto header = next_header()) {
+      bar::index::encode(records, raw, *header, tell(), codec_.path(), codec_.raw());
+      count++;
+      skip(*header);
+    }
+    rewind();
+    return *bar::index::build(raw, count, format());
+  }
+
+  // Back to the first entry.
+  void rewind() {
+    input_.seek(sizeof(BAR));
+    codec_ = bar::codec(format());
+  }
+
+  // Looks `path` up in the index and positions the input at its data,
+  // so it can be passed to `unpack` right away.
+  std::optional<entry> find(std::string_view path) {
+    if (!index_)
+      return std::nullopt;
+
+    const auto* rec = index_->find(path);
+    if (!rec)
+      return std::nullopt;
+
+    seek(*rec);
+    return rec->to_entry();
+  }
+
+  // Offset of the data of the entry just returned by `next_entry`.
+  auto tell() -> uint64_t { return input_.tell(); }
+
+  // Positions the input at the data of `rec`, for `unpack`. Front-coded
+  // paths only decode in order, so `next_entry` goes on after a `rewind`.
+  void seek(const bar::index::record& rec) { input_.seek(rec.offset); }
+
+  void unpack(const entry& entry, target& dest) {
+    stats::timer timer(stats_, stats::phase::payload);
+    if (stats_)
+      stats_->entry(entry.stored_size());
+
+    if (entry.is_del()) {
+      stats::timer meta(stats_, stats::phase::metadata);
+      dest.remove(entry.path());
+      return;
+    }
     if (entry.is_dir()) {
-      fs::create_directories(full_path);
-    } else if (entry.is_reg()) {
-      fs::create_directories(full_path.parent_path());
-      std::ofstream out(full_path, std::ios::binary);
-      if (entry.size() > 0) {
-        // TODO !use less suckless solution
-        std::vector<char> buf(65536);
-        for (uint64_t rem = entry.size(); rem > 0;) {
-          input_.read(buf.data(), std::min<uint64_t>(rem, buf.size()));
-          if (const auto n = input_.gcount()) {
-            out.write(buf.data(), n);
-            rem -= n;
-          } else {
-            break;
-          }
-        }
+      stats::timer meta(stats_, stats::phase::metadata);
+      dest.directory(entry.path(), entry);
+      return;
+    }
+    if (entry.is_sym() || entry.is_link()) {
+      if (entry.size() > entry::MAX_NAME)
+        throw std::runtime_error("corrupt bar archive: bad link in '" + entry.path().string() +
+                                 "'");
+      std::string to(entry.size(), '\0');
+      if (!read(to.data(), to.size()))
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      if (entry.has_crc())
+        input_.skip(sizeof(checksum::repr));
+      stats::timer meta(stats_, stats::phase::metadata);
+      if (entry.is_sym())
+        dest.symlink(entry.path(), to, entry);
+      else
+        dest.link(entry.path(), to);
+      return;
+    }
+    if (!entry.is_reg())
+      return;
+
+    target::place at;
+    {
+      stats::timer meta(stats_, stats::phase::metadata);
+      at = dest.locate(entry.path());
+    }
+    if (dest.syncing() && target::current(at, entry, stored_crc(entry))) {
+      skip(entry);
+      return;
+    }
+    if (entry.has_crc())
+      crc_ = 0;  // checked as it streams by
+    sys::fd out;
+    {
+      stats::timer meta(stats_, stats::phase::metadata);
+      out = target::create(at);
+    }
+    try {
+      if (entry.is_sparse()) {
+        unsparse(out.get(), entry.size(), at.path);
+      } else if (entry.is_compressed()) {
+        decompress(out.get(), entry.size(), at.path);
+      } else if (entry.is_chunked()) {
+        unchunk(out.get(), entry.size(), at.path);
+      } else {
+        copy(out.get(), entry.size(), at.path);
+      }
+      if (entry.has_crc()) {
+        const auto sum = std::exchange(crc_, std::nullopt);
+        checksum::repr tail;
+        if (!read(&tail, sizeof(tail)))
+          throw std::runtime_error("corrupt bar archive: truncated payload");
+        if (sum && sys::read_crc(&tail) != *sum)
+          throw std::runtime_error("corrupt bar archive: checksum mismatch in '" +
+                                   entry.path().string() + "'");
       }
+    } catch (...) {
+      crc_.reset();
+      target::discard(at);  // never left half written
+      throw;
     }
 
-    fs::permissions(full_path, entry.perms());
+    stats::timer meta(stats_, stats::phase::metadata);
+    target::restore(out.get(), entry, at.path);
+    target::commit(at);
+  }
+
+  // Record to extract the live `rec` of `index` from when only `scope` is
+  // extracted: `rec` itself, or for a hard link whose first name is left out
+  // or only comes later, the record of that name, whose contents it gets.
+  auto source_of(const bar::index& index, const bar::index::record& rec,
+                 const bar::glob& scope) -> const bar::index::record& {
+    if (rec.header.type != entry_type::link)
+      return rec;
+    if (rec.header.data > entry::MAX_NAME)
+      throw std::runtime_error("corrupt bar archive: bad link in '" + std::string(rec.path) +
+                               "'");
+    std::string to(rec.header.data, '\0');
+    if (read_at(to.data(), to.size(), rec.offset) != to.size())
+      throw std::runtime_error("corrupt bar archive: truncated payload");
+
+    const auto* first = index.find(to);
+    if (!first || first->header.type != entry_type::reg ||
+        (scope.matches(first->path) && first < &rec))
+      return rec;
+    return *first;
+  }
+
+  // Checksum stored after the payload of `entry`, which starts at the input
+  // position. Unknown for pipes, the bytes ahead can't be peeked at.
+  auto stored_crc(const entry& entry) -> std::optional<uint32_t> {
+    checksum::repr tail;
+    if (!entry.has_crc() || !input_.seekable() ||
+        read_at(&tail, sizeof(tail), input_.tell() + entry.size()) != sizeof(tail))
+      return std::nullopt;
+    return sys::read_crc(&tail);
+  }
+
+  // Copies `size` bytes of the input into `fd`. The read-ahead is written
+  // out straight from the source's buffer and the rest moves inside the
+  // kernel where the source allows it.
+  void copy(int fd, uint64_t size, const fs::path& path) {
+    if (const auto ahead = input_.buffered(); !ahead.empty()) {
+      const auto n = std::min<uint64_t>(size, ahead.size());
+      if (!sys::write_all(fd, ahead.data(), n))
+        sys::fail("write", path);
+      if (crc_)
+        crc_ = crc::crc32c(*crc_, ahead.data(), n);
+      input_.skip(n);
+      size -= n;
+    }
+    if (size > 0 && !crc_)
+      size -= input_.send(fd, size);
+
+    thread_local std::vector<char> buf(BUF_SIZE);
+    while (size > 0) {
+      const auto n = take(buf.data(), std::min<uint64_t>(size, buf.size()));
+      if (n == 0)
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      if (!sys::write_all(fd, buf.data(), n))
+        sys::fail("write", path);
+      size -= n;
+    }
+  }
+
+  // Decodes a `flag::lz` payload of `size` bytes into `fd`.
+  void decompress(int fd, uint64_t size, const fs::path& path) {
+    thread_local std::vector<char> packed, raw;
+    while (size >= sizeof(block::repr)) {
+      block::repr frame;
+      if (!read(&frame, sizeof(frame)))
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      const auto block = sys::read_block(&frame);
+      size -= sizeof(frame);
+      if (block.raw > block::SIZE || block.packed > size || block.packed > block.raw)
+        throw std::runtime_error("corrupt bar archive: bad block frame");
+
+      packed.resize(block.packed);
+      if (!read(packed.data(), block.packed))
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      size -= block.packed;
+
+      const char* data = packed.data();
+      if (block.packed < block.raw) {
+        raw.resize(block.raw);
+        if (lz::decompress(packed.data(), block.packed, raw.data(), raw.size()) != block.raw)
+          throw std::runtime_error("corrupt bar archive: bad lz block");
+        data = raw.data();
+      }
+      if (!sys::write_all(fd, data, block.raw))
+        sys::fail("write", path);
+    }
+    if (size != 0)
+      throw std::runtime_error("corrupt bar archive: bad block frame");
+  }
+
+  // Rebuilds a `flag::cdc` payload of `size` bytes into `fd`, reading the
+  // referenced chunks from where they were first stored. Without `fd` the
+  // payload is only read past, spilling the literal chunks of a pipe.
+  void unchunk(int fd, uint64_t size, const fs::path& path) {
+    while (size >= sizeof(chunk::repr)) {
+      chunk::repr rec;
+      if (!read(&rec, sizeof(rec)))
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      const auto chunk = sys::read_chunk(&rec);
+      size -= sizeof(rec);
+
+      if (chunk.ref == 0) {
+        if (chunk.size > size)
+          throw std::runtime_error("corrupt bar archive: bad chunk");
+        if (input_.seekable())
+          copy(fd, chunk.size, path);
+        else
+          spill(fd, chunk.size, path);
+        size -= chunk.size;
+      } else if (fd >= 0) {
+        copy_at(fd, chunk.ref, chunk.size, path);
+      }
+    }
+  }
+
+  // Rebuilds a `flag::sparse` payload of `size` bytes into `fd`. Extents are
+  // written at their offsets and the file is extended to its full size, so
+  // the holes are never written.
+  void unsparse(int fd, uint64_t size, const fs::path& path) {
+    sparse::repr head_buf;
+    if (size < sizeof(head_buf) || !read(&head_buf, sizeof(head_buf)))
+      throw std::runtime_error("corrupt bar archive: truncated payload");
+    const auto head = sys::read_sparse(&head_buf);
+    size -= sizeof(head_buf);
+    if (head.count > size / sizeof(extent::repr))
+      throw std::runtime_error("corrupt bar archive: bad extent map");
+
+    std::vector<extent_t> map(head.count);
+    for (auto& ext : map) {
+      extent::repr rec;
+      if (!read(&rec, sizeof(rec)))
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      ext = sys::read_extent(&rec);
+      size -= sizeof(rec);
+    }
+
+    for (const auto& ext : map) {
+      if (ext.length > size || ext.offset > head.size || ext.length > head.size - ext.offset)
+        throw std::runtime_error("corrupt bar archive: bad extent");
+      if (::lseek(fd, static_cast<off_t>(ext.offset), SEEK_SET) < 0)
+        sys::fail("lseek", path);
+      copy(fd, ext.length, path);
+      size -= ext.length;
+    }
+    if (::ftruncate(fd, static_cast<off_t>(head.size)) != 0)
+      sys::fail("ftruncate", path);
+  }
+
+  // Reads a literal chunk of `size` bytes from an unseekable input, passes it
+  // to `fd` if there is one and keeps it for later references.
+  void spill(int fd, uint64_t size, const fs::path& path) {
+    if (!spill_)
+      spill_ = sys::temp_file();
+    spilled_.emplace(input_.tell(), spill_size_);
+
+    thread_local std::vector<char> buf(BUF_SIZE);
+    while (size > 0) {
+      const auto n = take(buf.data(), std::min<uint64_t>(size, buf.size()));
+      if (n == 0)
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      if (fd >= 0 && !sys::write_all(fd, buf.data(), n))
+        sys::fail("write", path);
+      if (!sys::pwrite_all(spill_.get(), buf.data(), n, spill_size_))
+        sys::fail("write", "spill");
+      spill_size_ += n;
+      size -= n;
+    }
+  }
+
+  // Copies `size` bytes at the absolute `offset` into `fd`, the input
+  // position is left alone. An unseekable input serves them from the spill.
+  void copy_at(int fd, uint64_t offset, uint64_t size, const fs::path& path) {
+    auto from = input_.fd();
+    if (!input_.seekable()) {
+      const auto it = spilled_.find(offset);
+      if (it == spilled_.end())
+        throw std::runtime_error("corrupt bar archive: bad chunk reference");
+      from = spill_.get();
+      offset = it->second;
+    }
+    if (from >= 0) {
+      auto at = static_cast<off_t>(offset);
+      const auto moved = sys::transfer(from, &at, fd, size);
+      offset += moved;
+      size -= moved;
+    }
+
+    thread_local std::vector<char> buf(BUF_SIZE);
+    while (size > 0) {
+      const auto want = std::min<uint64_t>(size, buf.size());
+      const auto n = input_.seekable() ? read_at(buf.data(), want, offset)
+                                       : sys::pread_all(from, buf.data(), want, offset);
+      if (n == 0)
+        throw std::runtime_error("corrupt bar archive: truncated payload");
+      if (!sys::write_all(fd, buf.data(), n))
+        sys::fail("write", path);
+      offset += n;
+      size -= n;
+    }
+  }
+
+  // Reads up to `size` bytes at the absolute `offset`, the input position
+  // is left alone. Returns the bytes read, short only at the end.
+  auto read_at(void* data, size_t size, uint64_t offset) -> size_t {
+    return input_.pread(data, size, offset);
+  }
+
+  // Moves past the payload of `entry`. Chunked payloads of an unseekable
+  // input are read through, later entries may refer to their chunks.
+  void skip(const entry& entry) { skip(entry.header()); }
+
+ private:
+  void skip(const header_t& header) {
+    const auto crc = header.flags & flag::crc ? sizeof(checksum::repr) : 0;
+    if (header.flags & flag::cdc && !input_.seekable()) {
+      unchunk(-1, header.data, {});
+      input_.skip(crc);
+      return;
+    }
+    input_.skip(header.data + crc);
   }
 
-  void skip(const entry& entry) {
-    if (entry.size() > 0) {
-      input_.seekg(entry.size(), std::ios::cur);
+  // Decodes the next header, its path is `codec_.path()`. Filler and index
+  // entries are skipped.
+  auto next_header() -> std::optional<header_t> {
+    while (true) {
+      const auto header =
+          codec_.get([&](void* data, size_t size) { return read(data, size); });
+      if (!header || (header->type != entry_type::index && header->type != entry_type::pad))
+        return header;
+      skip(*header);
     }
   }
 };
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bar {
+
+// Fixed set of worker threads over a bounded job queue. `submit` blocks while
+// the queue is full, so a fast producer can't buffer the whole archive.
+class pool {
+  std::vector<std::jthread> workers_;
+  std::deque<std::function<void()>> queue_;
+  size_t limit_;
+  size_t busy_ = 0;
+  bool stop_ = false;
+  std::exception_ptr error_;
+
+  std::mutex mutex_;
+  std::condition_variable ready_;  // job queued or stopping
+  std::condition_variable space_;  // job taken or finished
+
+  void work() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock lock(mutex_);
+        ready_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+        if (queue_.empty())
+          return;
+        job = std::move(queue_.front());
+        queue_.pop_front();
+        busy_++;
+      }
+      space_.notify_all();
+
+      try {
+        job();
+      } catch (...) {
+        std::lock_guard lock(mutex_);
+        if (!error_)
+          error_ = std::current_exception();
+      }
+
+      {
+        std::lock_guard lock(mutex_);
+        busy_--;
+      }
+      space_.notify_all();
+    }
+  }
+
+ public:
+  static auto concurrency() -> size_t {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  explicit pool(size_t threads = concurrency(), size_t limit = 0)
+      : limit_(limit ? limit : 4 * std::max<size_t>(threads, 1)) {
+    threads = std::max<size_t>(threads, 1);
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back([this] { work(); });
+    }
+  }
+
+  pool(const pool&) = delete;
+  auto operator=(const pool&) -> pool& = delete;
+
+  ~pool() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    ready_.notify_all();
+    workers_.clear();  // join before the queue and locks go away
+  }
+
+  auto size() const { return workers_.size(); }
+
+  void submit(std::function<void()> job) {
+    {
+      std::unique_lock lock(mutex_);
+      space_.wait(lock, [&] { return queue_.size() < limit_; });
+      queue_.push_back(std::move(job));
+    }
+    ready_.notify_one();
+  }
+
+  // Blocks until every submitted job has run, then rethrows the first error.
+  void wait() {
+    std::unique_lock lock(mutex_);
+    space_.wait(lock, [&] { return queue_.empty() && busy_ == 0; });
+    if (error_)
+      std::rethrow_exception(std::exchange(error_, nullptr));
+  }
+};
+
+}  // namespace bar
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <format>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <sys/resource.h>
+
+namespace bar {
+
+// Counters and timers for one pack or extract run, shared by every thread
+// working on it. Components take a nullable `stats*` and do nothing without
+// one, so the disabled cost is a branch. Phase times are exclusive: a timer
+// pauses the one it is nested in on the same thread. They are summed over
+// threads and can exceed the wall time of a parallel run.
+class stats {
+ public:
+  enum struct phase : uint8_t {
+    walk,      // listing and stat of the inputs
+    header,    // encoding or decoding headers and paths
+    payload,   // moving, compressing or checking file contents
+    metadata,  // creating directories and files, permissions
+  };
+  constexpr static size_t PHASES = 4;
+  constexpr static std::array<std::string_view, PHASES> NAMES = {"walk", "header", "payload",
+                                                                 "metadata"};
+
+  using clock = std::chrono::steady_clock;
+
+  // Adds the time until it goes out of scope to `phase`.
+  class timer {
+    stats* stats_;
+    phase phase_;
+    clock::time_point start_;
+    timer* outer_ = nullptr;
+
+    static inline thread_local timer* active_ = nullptr;
+
+   public:
+    timer(stats* s, phase p) : stats_(s), phase_(p) {
+      if (!stats_)
+        return;
+      start_ = clock::now();
+      outer_ = std::exchange(active_, this);
+      if (outer_)
+        outer_->stats_->add(outer_->phase_, start_ - outer_->start_);
+    }
+    timer(const timer&) = delete;
+    auto operator=(const timer&) -> timer& = delete;
+    ~timer() {
+      if (!stats_)
+        return;
+      const auto now = clock::now();
+      stats_->add(phase_, now - start_);
+      active_ = outer_;
+      if (outer_)
+        outer_->start_ = now;
+    }
+  };
+
+ private:
+  clock::time_point start_ = clock::now();
+  std::array<std::atomic<uint64_t>, PHASES> nanos_{};
+  std::atomic<uint64_t> entries_ = 0;
+  std::atomic<uint64_t> bytes_ = 0;
+  // bucket `k` counts sizes in [2^(k-1), 2^k), bucket 0 the empty entries
+  std::array<std::atomic<uint64_t>, 65> sizes_{};
+
+  static auto human(double bytes) -> std::string {
+    constexpr std::string_view UNITS[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    size_t unit = 0;
+    for (; bytes >= 1024 && unit + 1 < std::size(UNITS); unit++) {
+      bytes /= 1024;
+    }
+    return unit ? std::format("{:.1f} {}", bytes, UNITS[unit])
+                : std::format("{:.0f} {}", bytes, UNITS[0]);
+  }
+
+  static auto cpu() -> std::pair<double, double> {
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    auto secs = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+    return {secs(usage.ru_utime), secs(usage.ru_stime)};
+  }
+
+ public:
+  void add(phase p, clock::duration took) {
+    nanos_[static_cast<size_t>(p)].fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(took).count(),
+        std::memory_order_relaxed);
+  }
+
+  // Counts an entry whose payload takes `size` bytes in the archive.
+  void entry(uint64_t size) {
+    entries_.fetch_add(1, std::memory_order_relaxed);
+    bytes_.fetch_add(size, std::memory_order_relaxed);
+    sizes_[std::bit_width(size)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  auto seconds(phase p) const -> double {
+    return nanos_[static_cast<size_t>(p)].load(std::memory_order_relaxed) / 1e9;
+  }
+
+  auto elapsed() const -> double {
+    return std::chrono::duration<double>(clock::now() - start_).count();
+  }
+
+  // Human readable summary, one quantity per line.
+  auto text() const -> std::string {
+    const auto wall = std::max(elapsed(), 1e-9);
+    const auto [user, sys] = cpu();
+    const auto entries = entries_.load();
+    const auto bytes = bytes_.load();
+
+    auto out = std::format("elapsed   {:.3f} s (cpu {:.3f} s user, {:.3f} s sys)\n", wall, user,
+                           sys);
+    out += std::format("entries   {} ({:.0f}/s)\n", entries, entries / wall);
+    out += std::format("bytes     {} ({}/s)\n", human(bytes), human(bytes / wall));
+    for (size_t i = 0; i < PHASES; ++i) {
+      const auto secs = seconds(static_cast<phase>(i));
+      out += std::format("{:<9} {:.3f} s ({:.0f}%)\n", NAMES[i], secs, 100 * secs / wall);
+    }
+    out += "sizes\n";
+    for (size_t k = 0; k < sizes_.size(); ++k) {
+      if (const auto n = sizes_[k].load()) {
+        const auto from = std::ldexp(1.0, static_cast<int>(k) - 1);
+        out += std::format("  {:>10} {}\n", k ? human(from) + "+" : "empty", n);
+      }
+    }
+    return out;
+  }
+
+  // Single JSON object with the same numbers, sizes keyed by log2 bucket.
+  auto json() const -> std::string {
+    const auto wall = std::max(elapsed(), 1e-9);
+    const auto [user, sys] = cpu();
+    const auto entries = entries_.load();
+    const auto bytes = bytes_.load();
+
+    auto out = std::format(
+        R"({{"elapsed_s":{:.6f},"cpu_user_s":{:.6f},"cpu_sys_s":{:.6f},"entries":{},)"
+        R"("bytes":{},"entries_per_s":{:.1f},"bytes_per_s":{:.1f},"phases_s":{{)",
+        wall, user, sys, entries, bytes, entries / wall, bytes / wall);
+    for (size_t i = 0; i < PHASES; ++i) {
+      out += std::format(R"({}"{}":{:.6f})", i ? "," : "", NAMES[i],
+                         seconds(static_cast<phase>(i)));
+    }
+    out += R"(},"log2_sizes":{)";
+    bool first = true;
+    for (size_t k = 0; k < sizes_.size(); ++k) {
+      if (const auto n = sizes_[k].load()) {
+        out += std::format(R"({}"{}":{})", first ? "" : ",", k, n);
+        first = false;
+      }
+    }
+    out += "}}";
+    return out;
+  }
+};
+
+}  // namespace bar
@@ -1,61 +1,444 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <bit>
+#include <climits>
 #include <cstdint>
 #include <cstring>
 #include <concepts>
+#include <filesystem>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
 #include "header.hxx"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
 namespace bar::sys {
 constexpr bool is_little_endian = (std::endian::native == std::endian::little);
 
 template <std::integral T>
-constexpr T bswap(T val) {
-  auto* bytes = reinterpret_cast<uint8_t*>(&val);
-  std::reverse(bytes, bytes + sizeof(T));
-  return val;
-}
-
-template <typename T>
 constexpr auto to_le(T val) -> T {
   if constexpr (is_little_endian) {
     return val;
   } else {
-    return bswap(val);
+    return std::byteswap(val);
   }
 }
 
-template <typename T>
+template <std::integral T>
 constexpr auto from_le(T val) -> T {
-  if constexpr (is_little_endian) {
-    return val;
+  return to_le(val);  // a swap is its own inverse
+}
+
+// Fixed-width records are stored little-endian. Each codec swaps the fields
+// of a copy and moves it in or out with `bit_cast`, so they all work in
+// constant expressions.
+
+constexpr void write_header(header::repr* buf, header_t header) {
+  header.path = to_le(header.path);
+  header.data = to_le(header.data);
+  header.mode = to_le(header.mode);
+  header.mtime = to_le(header.mtime);
+  *buf = std::bit_cast<header::repr>(header);
+}
+
+constexpr auto read_header(const header::repr* buf) -> header_t {
+  auto header = std::bit_cast<header_t>(*buf);
+  header.path = from_le(header.path);
+  header.data = from_le(header.data);
+  header.mode = from_le(header.mode);
+  header.mtime = from_le(header.mtime);
+  return header;
+}
+
+constexpr void write_trailer(trailer::repr* buf, trailer_t trailer) {
+  trailer.index = to_le(trailer.index);
+  trailer.count = to_le(trailer.count);
+  *buf = std::bit_cast<trailer::repr>(trailer);
+}
+
+constexpr auto read_trailer(const trailer::repr* buf) -> trailer_t {
+  auto trailer = std::bit_cast<trailer_t>(*buf);
+  trailer.index = from_le(trailer.index);
+  trailer.count = from_le(trailer.count);
+  return trailer;
+}
+
+constexpr void write_block(block::repr* buf, block_t block) {
+  block.raw = to_le(block.raw);
+  block.packed = to_le(block.packed);
+  *buf = std::bit_cast<block::repr>(block);
+}
+
+constexpr auto read_block(const block::repr* buf) -> block_t {
+  auto block = std::bit_cast<block_t>(*buf);
+  block.raw = from_le(block.raw);
+  block.packed = from_le(block.packed);
+  return block;
+}
+
+constexpr void write_chunk(chunk::repr* buf, chunk_t chunk) {
+  chunk.ref = to_le(chunk.ref);
+  chunk.size = to_le(chunk.size);
+  *buf = std::bit_cast<chunk::repr>(chunk);
+}
+
+constexpr auto read_chunk(const chunk::repr* buf) -> chunk_t {
+  auto chunk = std::bit_cast<chunk_t>(*buf);
+  chunk.ref = from_le(chunk.ref);
+  chunk.size = from_le(chunk.size);
+  return chunk;
+}
+
+constexpr void write_sparse(sparse::repr* buf, sparse_t head) {
+  head.size = to_le(head.size);
+  head.count = to_le(head.count);
+  *buf = std::bit_cast<sparse::repr>(head);
+}
+
+constexpr auto read_sparse(const sparse::repr* buf) -> sparse_t {
+  auto head = std::bit_cast<sparse_t>(*buf);
+  head.size = from_le(head.size);
+  head.count = from_le(head.count);
+  return head;
+}
+
+constexpr void write_extent(extent::repr* buf, extent_t ext) {
+  ext.offset = to_le(ext.offset);
+  ext.length = to_le(ext.length);
+  *buf = std::bit_cast<extent::repr>(ext);
+}
+
+constexpr auto read_extent(const extent::repr* buf) -> extent_t {
+  auto ext = std::bit_cast<extent_t>(*buf);
+  ext.offset = from_le(ext.offset);
+  ext.length = from_le(ext.length);
+  return ext;
+}
+
+constexpr void write_crc(checksum::repr* buf, uint32_t crc) {
+  *buf = std::bit_cast<checksum::repr>(to_le(crc));
+}
+
+constexpr auto read_crc(const checksum::repr* buf) -> uint32_t {
+  return from_le(std::bit_cast<uint32_t>(*buf));
+}
+
+static_assert([] {
+  header_t header{entry_type::dir, flag::crc, -2, 7, 0644, 1ull << 40};
+  header::repr buf{};
+  write_header(&buf, header);
+  const auto back = read_header(&buf);
+  return buf[2] == 0xfe && buf[10] == 7 && buf[17] == 0 && buf[21] == 1 &&
+         back.mtime == -2 && back.path == 7 && back.mode == 0644 && back.data == 1ull << 40;
+}());
+
+// Owning file descriptor.
+class fd {
+  int fd_ = -1;
+
+ public:
+  fd() = default;
+  explicit fd(int raw) : fd_(raw) {}
+
+  fd(fd&& other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+  auto operator=(fd&& other) noexcept -> fd& {
+    if (this != &other) {
+      reset();
+      fd_ = std::exchange(other.fd_, -1);
+    }
+    return *this;
+  }
+
+  fd(const fd&) = delete;
+  auto operator=(const fd&) -> fd& = delete;
+
+  ~fd() { reset(); }
+
+  auto get() const { return fd_; }
+  explicit operator bool() const { return fd_ >= 0; }
+
+  void reset() {
+    if (fd_ >= 0)
+      ::close(std::exchange(fd_, -1));
+  }
+};
+
+[[noreturn]] inline void fail(const char* what, const std::filesystem::path& path) {
+  throw std::filesystem::filesystem_error(what, path,
+                                          std::error_code(errno, std::generic_category()));
+}
+
+inline auto open(const std::filesystem::path& path, int flags, mode_t mode = 0) -> fd {
+  fd file(::open(path.c_str(), flags | O_CLOEXEC, mode));
+  if (!file)
+    fail("open", path);
+  return file;
+}
+
+// Anonymous file in the temporary directory, gone once closed.
+inline auto temp_file() -> fd {
+  const auto dir = std::filesystem::temp_directory_path();
+#if defined(O_TMPFILE)
+  if (fd file(::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)); file)
+    return file;
+#endif
+  auto name = (dir / "bar-XXXXXX").string();
+  fd file(::mkostemp(name.data(), O_CLOEXEC));
+  if (!file)
+    fail("mkstemp", dir);
+  ::unlink(name.c_str());
+  return file;
+}
+
+// Reads exactly `size` bytes at `offset` unless the file ends first.
+inline auto pread_all(int fd, void* data, size_t size, uint64_t offset) -> size_t {
+  size_t done = 0;
+  while (done < size) {
+    auto n = ::pread(fd, static_cast<char*>(data) + done, size - done,
+                     static_cast<off_t>(offset + done));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+// Size of the file stored in the `flag::lz`, `flag::cdc` or `flag::sparse`
+// payload of `header` at `offset`, from its frames alone, which
+// `pread(data, size, offset)` reads. The stored size for any other payload.
+template <typename F>
+auto raw_size(const header_t& header, uint64_t offset, F&& pread) -> uint64_t {
+  const auto end = offset + header.data;
+  auto get = [&](void* data, size_t size) {
+    if (end - offset < size || pread(data, size, offset) != size)
+      throw std::runtime_error("corrupt bar archive: truncated payload");
+  };
+
+  uint64_t size = 0;
+  if (header.flags & flag::sparse) {
+    sparse::repr head;
+    get(&head, sizeof(head));
+    size = read_sparse(&head).size;
+  } else if (header.flags & flag::lz) {
+    while (end - offset >= sizeof(block::repr)) {
+      block::repr frame;
+      get(&frame, sizeof(frame));
+      const auto block = read_block(&frame);
+      offset += sizeof(frame);
+      if (block.raw > block::SIZE || block.packed > end - offset)
+        throw std::runtime_error("corrupt bar archive: bad block frame");
+      size += block.raw;
+      offset += block.packed;
+    }
+    if (offset != end)
+      throw std::runtime_error("corrupt bar archive: bad block frame");
+  } else if (header.flags & flag::cdc) {
+    while (end - offset >= sizeof(chunk::repr)) {
+      chunk::repr rec;
+      get(&rec, sizeof(rec));
+      const auto chunk = read_chunk(&rec);
+      offset += sizeof(rec);
+      if (chunk.ref == 0 && chunk.size > end - offset)
+        throw std::runtime_error("corrupt bar archive: bad chunk");
+      size += chunk.size;
+      offset += chunk.ref == 0 ? chunk.size : 0;
+    }
   } else {
-    return bswap(val);
+    size = header.data;
   }
+  return size;
 }
 
-void write_header(header::repr* buf, header_t header) {
-  if constexpr (is_little_endian) {
-    header.path = to_le(header.path);
-    header.data = to_le(header.data);
-    header.mode = to_le(header.mode);
-    header.mtime = to_le(header.mtime);
+inline auto pwrite_all(int fd, const void* data, size_t size, uint64_t offset) -> bool {
+  for (size_t done = 0; done < size;) {
+    auto n = ::pwrite(fd, static_cast<const char*>(data) + done, size - done,
+                      static_cast<off_t>(offset + done));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    done += n;
   }
-  std::memcpy(buf, &header, sizeof(header_t));
+  return true;
 }
 
-header_t read_header(const header::repr* buf) {
-  header_t header;
-  std::memcpy(&header, buf, sizeof(header_t));
+inline auto write_all(int fd, const void* data, size_t size) -> bool {
+  for (size_t done = 0; done < size;) {
+    auto n = ::write(fd, static_cast<const char*>(data) + done, size - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
 
-  if constexpr (is_little_endian) {
-    header.path = from_le(header.path);
-    header.data = from_le(header.data);
-    header.mode = from_le(header.mode);
-    header.mtime = from_le(header.mtime);
+// Writes every part in order, gathering them into as few syscalls as the
+// kernel allows. The parts are consumed as they go out.
+inline auto writev_all(int fd, std::span<iovec> parts) -> bool {
+  while (!parts.empty()) {
+    if (parts[0].iov_len == 0) {
+      parts = parts.subspan(1);
+      continue;
+    }
+    const auto count = static_cast<int>(std::min<size_t>(parts.size(), IOV_MAX));
+    auto n = ::writev(fd, parts.data(), count);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    while (!parts.empty() && static_cast<size_t>(n) >= parts[0].iov_len) {
+      n -= static_cast<ssize_t>(parts[0].iov_len);
+      parts = parts.subspan(1);
+    }
+    if (!parts.empty()) {
+      parts[0].iov_base = static_cast<char*>(parts[0].iov_base) + n;
+      parts[0].iov_len -= n;
+    }
   }
-  return header;
+  return true;
+}
+
+// Shares `size` bytes of `in` at `in_at` with `out` at `out_at` on a
+// copy-on-write filesystem instead of copying them. Offsets and size must be
+// block aligned. Neither file offset moves.
+inline auto clone(int in, uint64_t in_at, int out, uint64_t out_at, uint64_t size) -> bool {
+#if defined(FICLONERANGE)
+  static std::atomic<bool> supported = true;
+  if (!supported.load(std::memory_order_relaxed))
+    return false;
+
+  file_clone_range range{};
+  range.src_fd = in;
+  range.src_offset = in_at;
+  range.src_length = size;
+  range.dest_offset = out_at;
+  if (::ioctl(out, FICLONERANGE, &range) == 0)
+    return true;
+  if (errno == EOPNOTSUPP || errno == ENOTTY)
+    supported.store(false, std::memory_order_relaxed);
+#else
+  (void)in, (void)in_at, (void)out, (void)out_at, (void)size;
+#endif
+  return false;
+}
+
+// Copies up to `size` bytes of the regular file `in` at `in_at` to `out` at
+// `out_at` inside the kernel, moving neither file offset, so threads can fill
+// disjoint ranges of one file. Whole blocks at matching alignment are cloned.
+// Returns how much was copied, the caller copies the rest by hand.
+inline auto copy_range(int in, uint64_t in_at, int out, uint64_t out_at, uint64_t size)
+    -> uint64_t {
+  uint64_t done = 0;
+#if defined(__linux__)
+  auto step = [&](uint64_t until) {
+    while (done < until) {
+      auto from = static_cast<loff_t>(in_at + done);
+      auto to = static_cast<loff_t>(out_at + done);
+      const auto n =
+          ::copy_file_range(in, &from, out, &to, std::min<uint64_t>(until - done, 1 << 30), 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      done += n;
+    }
+  };
+
+  if (in_at % ALIGN == out_at % ALIGN) {
+    const auto head = (ALIGN - in_at % ALIGN) % ALIGN;
+    if (size >= head + ALIGN) {
+      step(head);
+      const auto blocks = (size - done) & ~(ALIGN - 1);
+      if (done == head && clone(in, in_at + head, out, out_at + head, blocks))
+        done += blocks;
+    }
+  }
+  step(size);
+#else
+  (void)in, (void)in_at, (void)out, (void)out_at, (void)size;
+#endif
+  return done;
+}
+
+// Moves up to `size` bytes from `in` to `out` without a userspace copy:
+// `copy_file_range` between regular files, `splice` or `sendfile` when a pipe
+// is involved. Reads at `*in_off` if given, else at the current offset.
+// Returns how much was moved, the caller copies the rest by hand.
+//
+// Between regular files whose offsets agree modulo `ALIGN`, the whole blocks
+// in the middle are cloned, so aligned payloads extract as reflinks.
+inline auto transfer(int in, off_t* in_off, int out, uint64_t size) -> uint64_t {
+  uint64_t done = 0;
+#if defined(__linux__)
+  static_assert(sizeof(off_t) == sizeof(loff_t));
+  auto* in_loff = reinterpret_cast<loff_t*>(in_off);
+
+  struct stat in_st, out_st;
+  if (::fstat(in, &in_st) != 0 || ::fstat(out, &out_st) != 0)
+    return 0;
+
+  auto step = [&](auto&& call, uint64_t until) {
+    while (done < until) {
+      const auto n = call(std::min<uint64_t>(until - done, 1 << 30));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      done += n;
+    }
+  };
+  auto copy_range = [&](size_t len) {
+    return ::copy_file_range(in, in_loff, out, nullptr, len, 0);
+  };
+
+  if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+    const auto in_at = in_off ? *in_off : ::lseek(in, 0, SEEK_CUR);
+    const auto out_at = ::lseek(out, 0, SEEK_CUR);
+    if (in_at >= 0 && out_at >= 0 && (in_at - out_at) % ALIGN == 0) {
+      const auto head = (ALIGN - in_at % ALIGN) % ALIGN;
+      if (size >= head + ALIGN) {
+        step(copy_range, head);
+        const auto blocks = (size - done) & ~(ALIGN - 1);
+        if (done == head && clone(in, in_at + head, out, out_at + head, blocks)) {
+          if (in_off)
+            *in_off += blocks;
+          else
+            ::lseek(in, static_cast<off_t>(blocks), SEEK_CUR);
+          ::lseek(out, static_cast<off_t>(blocks), SEEK_CUR);
+          done += blocks;
+        }
+      }
+    }
+    step(copy_range, size);
+  }
+  if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+    step([&](size_t len) { return ::splice(in, in_loff, out, nullptr, len, 0); }, size);
+  }
+  if (S_ISREG(in_st.st_mode)) {
+    // any output, e.g. sockets or cross-fs copies on older kernels
+    step([&](size_t len) { return ::sendfile(out, in, in_off, len); }, size);
+  }
+#else
+  (void)in, (void)in_off, (void)out, (void)size;
+#endif
+  return done;
 }
 
 }  // namespace bar::sys
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+#include <format>
+#include "crc.hxx"
+#include "entry.hxx"
+#include "glob.hxx"
+#include "sys.hxx"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace bar {
+
+struct target_options {
+  bool sync = false;   // keep files matching their entry, replace the others atomically
+  bool prune = false;  // remove files under `scope` the extraction didn't produce
+  bar::glob scope;     // the entries extracted, everything when empty
+};
+
+// Destination tree of an extraction. Everything is created relative to open
+// directory descriptors: the directories of the last parent stay open, and
+// archives keep siblings together, so most entries cost a single `openat`.
+// Mode and mtime are restored on the open descriptor. Directories get theirs
+// in `finish`, after their children: adding a child would bump the mtime and
+// a read-only directory would reject it.
+//
+// With `sync`, files that already match their entry are left alone and the
+// others are written to a temporary name and renamed over the old file, so a
+// reader never sees a partial one.
+class target {
+ public:
+  using dir_ptr = std::shared_ptr<const sys::fd>;
+
+  // Where a file goes: its open parent and its name there.
+  struct place {
+    dir_ptr dir;
+    std::string name;
+    fs::path path;     // for errors
+    std::string temp;  // with `sync`, written under this name until `commit`
+  };
+
+ private:
+  struct level {
+    std::string name;
+    dir_ptr fd;
+  };
+  struct meta {
+    fs::perms perms;
+    int64_t mtime;
+  };
+
+  fs::path root_path_;
+  target_options opts_;
+  dir_ptr root_;
+  std::vector<level> open_;  // directories of the last parent, outermost first
+  // deferred directory metadata, deepest first as a path sorts after its parent
+  std::map<std::string, meta, std::greater<>> dirs_;
+  std::unordered_set<std::string> claimed_;  // with `prune`, paths and their parents
+  uint64_t temps_ = 0;
+
+  constexpr static size_t BUF_SIZE = 256 * 1024;
+
+  // Symlinks are only followed with `follow`, so an extracted one can't lead
+  // the entries below it out of the tree.
+  static auto open_dir(int parent, const char* name, bool follow = false) -> sys::fd {
+    const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow ? 0 : O_NOFOLLOW);
+    return sys::fd(::openat(parent, name, flags));
+  }
+
+  // Creates `at` with `make(name)`, which returns 0 or sets errno, replacing
+  // a file, link or empty directory that is in the way.
+  template <typename F>
+  static void replace(const place& at, const char* what, F&& make) {
+    const auto& name = at.temp.empty() ? at.name : at.temp;
+    const auto dir = at.dir->get();
+    auto made = make(name.c_str()) == 0;
+    if (!made && errno == EEXIST &&
+        (::unlinkat(dir, name.c_str(), 0) == 0 ||
+         (errno == EISDIR && ::unlinkat(dir, name.c_str(), AT_REMOVEDIR) == 0)))
+      made = make(name.c_str()) == 0;
+    if (!made)
+      sys::fail(what, at.path);
+  }
+
+  static void apply(int fd, fs::perms perms, int64_t mtime, const fs::path& path) {
+    if (::fchmod(fd, static_cast<mode_t>(perms)) != 0)
+      sys::fail("fchmod", path);
+    const timespec times[2] = {{0, UTIME_OMIT}, {mtime, 0}};
+    if (::futimens(fd, times) != 0)
+      sys::fail("futimens", path);
+  }
+
+  // Generic form of the entry path `rel`, which has to stay below the root:
+  // an absolute path or a `..` component is rejected before anything is
+  // touched.
+  static auto confine(const fs::path& rel) -> std::string {
+    auto path = rel.generic_string();
+    bool escapes = rel.has_root_path();
+    for (const auto& part : rel) {
+      escapes |= part == "..";
+    }
+    if (escapes)
+      throw std::runtime_error("corrupt bar archive: path '" + path +
+                               "' leaves the destination");
+    return path;
+  }
+
+  // Drops the state kept for the directory `path`, which is being replaced.
+  void forget(const std::string& path) {
+    if (dirs_.erase(path))
+      open_.clear();
+  }
+
+  // Opens the directory `rel`, creating what is missing. Components shared
+  // with the previous call are reused.
+  auto dir(std::string_view rel) -> dir_ptr {
+    const auto whole = rel;
+    auto dir = root_;
+    size_t depth = 0;
+    while (!rel.empty()) {
+      const auto slash = rel.find('/');
+      const auto name = rel.substr(0, slash);
+      rel.remove_prefix(slash == std::string_view::npos ? rel.size() : slash + 1);
+      if (name.empty() || name == ".")
+        continue;
+
+      if (depth < open_.size() && open_[depth].name == name) {
+        dir = open_[depth++].fd;
+        continue;
+      }
+      open_.resize(depth);
+
+      const std::string sub(name);
+      auto error_path = [&] {
+        return root_path_ / whole.substr(0, name.data() + name.size() - whole.data());
+      };
+      auto fd = open_dir(dir->get(), sub.c_str());
+      if (!fd && (errno == ENOTDIR || errno == ELOOP) &&
+          ::unlinkat(dir->get(), sub.c_str(), 0) == 0)
+        errno = ENOENT;  // a file or symlink was in the way
+      if (!fd && errno == ENOENT) {
+        if (::mkdirat(dir->get(), sub.c_str(), 0777) != 0 && errno != EEXIST)
+          sys::fail("mkdir", error_path());
+        fd = open_dir(dir->get(), sub.c_str());
+      }
+      if (!fd)
+        sys::fail("open", error_path());
+      dir = std::make_shared<const sys::fd>(std::move(fd));
+      open_.push_back({sub, dir});
+      depth++;
+    }
+    return dir;
+  }
+
+ public:
+  // Records `rel` and its parents as produced by the extraction.
+  void claim(std::string_view rel) {
+    if (!opts_.prune)
+      return;
+    while (!rel.empty() && claimed_.emplace(rel).second) {
+      const auto slash = rel.rfind('/');
+      rel = rel.substr(0, slash == std::string_view::npos ? 0 : slash);
+    }
+  }
+
+  // Removes what is under `scope` and wasn't claimed.
+  void prune() {
+    std::vector<fs::path> extra;
+    for (auto it = fs::recursive_directory_iterator(root_path_);
+         it != fs::recursive_directory_iterator(); ++it) {
+      const auto rel = it->path().lexically_relative(root_path_).generic_string();
+      if (claimed_.contains(rel) || !opts_.scope.matches(rel))
+        continue;
+      extra.push_back(it->path());
+      it.disable_recursion_pending();
+    }
+    for (const auto& path : extra) {
+      fs::remove_all(path);
+    }
+  }
+
+ public:
+  explicit target(const fs::path& root, target_options opts = {})
+      : root_path_(root), opts_(std::move(opts)) {
+    fs::create_directories(root_path_);
+    auto fd = open_dir(AT_FDCWD, root_path_.c_str(), true);
+    if (!fd)
+      sys::fail("open", root_path_);
+    root_ = std::make_shared<const sys::fd>(std::move(fd));
+  }
+
+  auto& root() const { return root_path_; }
+  bool syncing() const { return opts_.sync; }
+
+  // Parent and name of the file `rel`, with the parent created.
+  auto locate(const fs::path& rel) -> place {
+    claim(confine(rel));
+    place at{dir(rel.parent_path().generic_string()), rel.filename().string(),
+             root_path_ / rel, {}};
+    if (opts_.sync)
+      at.temp = std::format(".bar-{}-{}", ::getpid(), temps_++);
+    return at;
+  }
+
+  // Whether the file at `at` already holds `entry`: same mode and mtime and,
+  // for a plain payload, the same size and contents matching the stored
+  // checksum `crc`, if there is one. Transformed payloads rely on the mtime,
+  // like `bottle::unchanged`. Safe on any thread.
+  static auto current(const place& at, const entry& entry, std::optional<uint32_t> crc)
+      -> bool {
+    struct stat st;
+    if (::fstatat(at.dir->get(), at.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !S_ISREG(st.st_mode) || st.st_mtime != entry.mtime() ||
+        (static_cast<fs::perms>(st.st_mode) & fs::perms::mask) != entry.perms())
+      return false;
+    if (entry.is_compressed() || entry.is_chunked() || entry.is_sparse())
+      return true;
+    if (static_cast<uint64_t>(st.st_size) != entry.size())
+      return false;
+    if (!crc)
+      return true;
+
+    sys::fd file(::openat(at.dir->get(), at.name.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!file)
+      return false;
+    thread_local std::vector<char> buf(BUF_SIZE);
+    uint32_t sum = 0;
+    uint64_t offset = 0;
+    while (const auto n = sys::pread_all(file.get(), buf.data(), buf.size(), offset)) {
+      sum = crc::crc32c(sum, buf.data(), n);
+      offset += n;
+    }
+    return offset == entry.size() && sum == *crc;
+  }
+
+  // Creates the file at `at` for writing. Whatever was there is unlinked
+  // rather than truncated: writing through it would change the target of a
+  // symlink, or every other name of a hard link. Safe on any thread.
+  static auto create(const place& at) -> sys::fd {
+    constexpr int FLAGS = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+    const auto& name = at.temp.empty() ? at.name : at.temp;
+    sys::fd file(::openat(at.dir->get(), name.c_str(), FLAGS, 0600));
+    if (!file && errno == EEXIST && ::unlinkat(at.dir->get(), name.c_str(), 0) == 0)
+      file = sys::fd(::openat(at.dir->get(), name.c_str(), FLAGS, 0600));
+    if (!file)
+      sys::fail("open", at.path);
+    return file;
+  }
+
+  // Creates the symlink `rel` to `to` with the mtime of `entry`. With `sync`
+  // a link already pointing at `to` is kept.
+  void symlink(const fs::path& rel, const std::string& to, const entry& entry) {
+    const auto at = locate(rel);
+    forget(rel.generic_string());
+    if (opts_.sync) {
+      std::string now(to.size() + 1, '\0');
+      const auto n = ::readlinkat(at.dir->get(), at.name.c_str(), now.data(), now.size());
+      if (n >= 0 && static_cast<size_t>(n) == to.size() && now.starts_with(to))
+        return;
+    }
+    replace(at, "symlink", [&](const char* name) {
+      return ::symlinkat(to.c_str(), at.dir->get(), name);
+    });
+    const auto& name = at.temp.empty() ? at.name : at.temp;
+    const timespec times[2] = {{0, UTIME_OMIT}, {entry.mtime(), 0}};
+    if (::utimensat(at.dir->get(), name.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+      sys::fail("utimensat", at.path);
+    commit(at);
+  }
+
+  // Makes `rel` another name of the already extracted file `to`, both
+  // relative to the root. With `sync` a name already sharing it is kept.
+  void link(const fs::path& rel, const fs::path& to) {
+    // only read in order, without an index, can a link lose its first name
+    if (!opts_.scope.matches(confine(to)))
+      throw std::runtime_error("'" + rel.string() + "' is a hard link to '" + to.string() +
+                               "', which is not extracted");
+    const auto from = dir(to.parent_path().generic_string());
+    const auto from_name = to.filename().string();
+    const auto at = locate(rel);
+    forget(rel.generic_string());
+    if (opts_.sync) {
+      struct stat have, want;
+      if (::fstatat(at.dir->get(), at.name.c_str(), &have, AT_SYMLINK_NOFOLLOW) == 0 &&
+          ::fstatat(from->get(), from_name.c_str(), &want, AT_SYMLINK_NOFOLLOW) == 0 &&
+          have.st_dev == want.st_dev && have.st_ino == want.st_ino)
+        return;
+    }
+    replace(at, "link", [&](const char* name) {
+      return ::linkat(from->get(), from_name.c_str(), at.dir->get(), name, 0);
+    });
+    commit(at);
+  }
+
+  // Moves a file written under a temporary name into place. Safe on any thread.
+  static void commit(const place& at) {
+    if (at.temp.empty())
+      return;
+    if (::renameat(at.dir->get(), at.temp.c_str(), at.dir->get(), at.name.c_str()) != 0)
+      sys::fail("rename", at.path);
+  }
+
+  // Removes the file `create` made at `at`, whose contents turned out to be
+  // corrupt. Safe on any thread.
+  static void discard(const place& at) {
+    const auto& name = at.temp.empty() ? at.name : at.temp;
+    ::unlinkat(at.dir->get(), name.c_str(), 0);
+  }
+
+  // Applies the mode and mtime of `entry` to the open `fd`. Safe on any thread;
+  // the file must not be written afterwards.
+  static void restore(int fd, const entry& entry, const fs::path& path) {
+    apply(fd, entry.perms(), entry.mtime(), path);
+  }
+
+  // Creates the directory `rel`, its metadata waits for `finish`.
+  void directory(const fs::path& rel, const entry& entry) {
+    const auto path = confine(rel);
+    claim(path);
+    dir(path);
+    dirs_.insert_or_assign(path, meta{entry.perms(), entry.mtime()});
+  }
+
+  // Removes `rel` and everything below it. Nothing is removed through a
+  // symlink, `rel` is gone already if one of its parents is not a directory.
+  void remove(const fs::path& rel) {
+    const auto path = confine(rel);
+    if (rel.lexically_normal() == "." || path.empty())
+      throw std::runtime_error("corrupt bar archive: tombstone for the destination itself");
+    open_.clear();
+    claimed_.erase(path);
+    std::erase_if(dirs_, [&](const auto& it) {
+      return it.first.starts_with(path) &&
+             (it.first.size() == path.size() || it.first[path.size()] == '/');
+    });
+    for (auto slash = path.find('/'); slash != std::string::npos;
+         slash = path.find('/', slash + 1)) {
+      struct stat st;
+      const auto parent = path.substr(0, slash);
+      if (::fstatat(root_->get(), parent.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+          !S_ISDIR(st.st_mode))
+        return;
+    }
+    fs::remove_all(root_path_ / rel);
+  }
+
+  // Prunes if asked to, then applies the deferred directory metadata,
+  // children before parents.
+  void finish() {
+    open_.clear();
+    if (opts_.prune)
+      prune();
+    for (const auto& [path, meta] : dirs_) {
+      const auto full_path = root_path_ / path;
+      auto fd = open_dir(root_->get(), path.c_str());
+      if (!fd)
+        sys::fail("open", full_path);
+      apply(fd.get(), meta.perms, meta.mtime, full_path);
+    }
+    dirs_.clear();
+  }
+};
+
+}  // namespace bar
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "pool.hxx"
+#include "sys.hxx"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace bar {
+
+// Parallel directory walker. Workers list directories with big `getdents64`
+// batches and `fstatat` every child relative to the directory fd, while the
+// caller consumes the tree in a deterministic pre-order (children sorted by
+// name). Listings run ahead of the consumer on all threads, which only waits
+// for the directory it is about to enter.
+class walker {
+  struct node;
+
+  struct item {
+    std::string name;
+    struct stat st;
+    std::unique_ptr<node> dir;  // set for directories
+  };
+
+  struct node {
+    std::string path;  // relative to the base directory
+    std::vector<item> items;
+    std::exception_ptr error;
+    bool ready = false;
+  };
+
+  sys::fd base_;
+  std::string root_;
+  struct stat root_st_{};
+
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  // listing tasks spawn more tasks, so the queue must never block
+  pool pool_;
+
+  constexpr static size_t DENTS_SIZE = 1 << 20;
+
+  template <typename F>
+  static void read_dir(int dir_fd, F&& fn) {
+#if defined(__linux__)
+    // fixed part of a `linux_dirent64`, the name follows `d_type`
+    struct dirent_head {
+      ino64_t d_ino;
+      off64_t d_off;
+      unsigned short d_reclen;
+      unsigned char d_type;
+    };
+    constexpr auto NAME_AT = offsetof(dirent_head, d_type) + 1;
+
+    thread_local std::vector<char> buf(DENTS_SIZE);
+    while (true) {
+      auto n = ::syscall(SYS_getdents64, dir_fd, buf.data(), buf.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        throw fs::filesystem_error("getdents64",
+                                   std::error_code(errno, std::generic_category()));
+      if (n == 0)
+        return;
+      for (long at = 0; at < n;) {
+        const auto* dent = reinterpret_cast<const dirent_head*>(buf.data() + at);
+        fn(static_cast<const char*>(buf.data() + at + NAME_AT));
+        at += dent->d_reclen;
+      }
+    }
+#else
+    DIR* dir = ::fdopendir(::dup(dir_fd));
+    if (!dir)
+      throw fs::filesystem_error("fdopendir", std::error_code(errno, std::generic_category()));
+    while (const auto* dent = ::readdir(dir)) {
+      fn(static_cast<const char*>(dent->d_name));
+    }
+    ::closedir(dir);
+#endif
+  }
+
+  void list(node* dir) {
+    try {
+      sys::fd fd(::openat(base_.get(), dir->path.c_str(),
+                          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+      if (!fd)
+        sys::fail("openat", dir->path);
+
+      read_dir(fd.get(), [&](const char* name) {
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+          return;
+        item it{name, {}, nullptr};
+        if (::fstatat(fd.get(), name, &it.st, AT_SYMLINK_NOFOLLOW) != 0)
+          return;  // vanished since listing
+        dir->items.push_back(std::move(it));
+      });
+
+      std::ranges::sort(dir->items, {}, &item::name);
+      for (auto& it : dir->items) {
+        if (S_ISDIR(it.st.st_mode)) {
+          it.dir = std::make_unique<node>();
+          it.dir->path = dir->path + '/' + it.name;
+          pool_.submit([this, child = it.dir.get()] { list(child); });
+        }
+      }
+    } catch (...) {
+      dir->error = std::current_exception();
+    }
+
+    {
+      std::lock_guard lock(mutex_);
+      dir->ready = true;
+    }
+    ready_.notify_all();
+  }
+
+  template <typename F>
+  void visit(node& dir, int parent_fd, const std::string& name, F& fn) {
+    {
+      std::unique_lock lock(mutex_);
+      ready_.wait(lock, [&] { return dir.ready; });
+    }
+    if (dir.error)
+      std::rethrow_exception(dir.error);
+
+    sys::fd fd(::openat(parent_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!fd)
+      sys::fail("openat", dir.path);
+
+    for (auto& it : dir.items) {
+      const auto rel = dir.path + '/' + it.name;
+      fn(rel, fd.get(), it.name.c_str(), it.st);
+      if (it.dir) {
+        visit(*it.dir, fd.get(), it.name, fn);
+        it.dir.reset();
+      }
+    }
+  }
+
+ public:
+  explicit walker(const fs::path& path, size_t jobs = pool::concurrency())
+      : pool_(jobs, std::numeric_limits<size_t>::max()) {
+    auto abs = fs::absolute(path).lexically_normal();
+    if (!abs.has_filename())
+      abs = abs.parent_path();
+
+    base_ = sys::open(abs.parent_path(), O_RDONLY | O_DIRECTORY);
+    root_ = abs.filename().generic_string();
+    if (::fstatat(base_.get(), root_.c_str(), &root_st_, AT_SYMLINK_NOFOLLOW) != 0)
+      sys::fail("fstatat", abs);
+  }
+
+  // Name of the walked path in the archive, the prefix of everything below it.
+  auto& root() const { return root_; }
+
+  // Calls `fn(rel_path, dir_fd, name, st)` for the root and everything below
+  // it; `name` can be opened relative to `dir_fd` for the duration of the call.
+  template <typename F>
+  void walk(F&& fn) {
+    fn(root_, base_.get(), root_.c_str(), root_st_);
+    if (!S_ISDIR(root_st_.st_mode))
+      return;
+
+    node root{root_, {}, nullptr, false};
+    pool_.submit([this, &root] { list(&root); });
+    try {
+      visit(root, base_.get(), root_, fn);
+    } catch (...) {
+      // listings still in flight point into the tree
+      pool_.wait();
+      throw;
+    }
+  }
+};
+
+}  // namespace bar
@@ -1,10 +1,15 @@
 #include <cstdio>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <mutex>
+#include <optional>
+#include <iterator>
+#include <string>
 #include <filesystem>
 #include <bar.hxx>
 #include <format>
-#include <ostream>
 
 #include "utils/argh.h"
 
@@ -12,54 +17,281 @@ namespace fs = std::filesystem;
 
 constexpr auto USAGE =
     R"(usage: bar <command> [options] <archive> [files...]
+       bar x [options] <archive> [--] [patterns...]
+       bar m [options] <archive> <archives...>
     commands:
       a                Add files to archive
-      x                Extract files with full paths
+      x                Extract files with full paths (all, or those matching a pattern)
       l                List contents of archive
+      m                Merge archives into a new one, later ones win on equal paths
+      t                Test the checksums of all entries
+    archive:
+      -                Write to stdout with a and m, read from stdin with x and l
     options:
+     -o, --output      Extract into this directory
+     -j, --jobs N      Use N threads to pack, extract or test (0 = all cores)
+     -z, --compress    Compress files in independent lz blocks
+     -d, --dedup       Store identical chunks of files only once
+     -u, --update      Append only new and changed files to an existing archive
+     -c, --checksum    Store a crc32c after every file, checked on extraction
+     -a, --align       Start file contents on 4 KiB boundaries, for reflink extraction
+     --format N        Write format N, 1 for readers older than format 2 (default: 2)
+     --sync            Extract only files that differ from the ones on disk, atomically
+     --delete          Remove files under the output that are not in the archive
+     --exclude GLOB    Leave out the entries matching GLOB when merging
+     --stats[=json]    Print timings and entry sizes of add or extract to stderr
      -h, --help        Show this help message
     )";
 
-auto add(const fs::path& archive_file, const std::vector<fs::path>& inputs) -> int {
-  std::ofstream out(archive_file, std::ios::binary);
-  bar::bottle b(out);
+// Opens the archive, `-` being stdin for reading and stdout for writing.
+auto open_archive(const fs::path& archive_file, int flags, mode_t mode = 0) -> bar::sys::fd {
+  if (archive_file != "-")
+    return bar::sys::open(archive_file, flags, mode);
+
+  const auto std_fd = (flags & O_ACCMODE) == O_RDONLY ? STDIN_FILENO : STDOUT_FILENO;
+  bar::sys::fd fd(::fcntl(std_fd, F_DUPFD_CLOEXEC, 0));
+  if (!fd)
+    bar::sys::fail("dup", archive_file);
+  return fd;
+}
+
+// Exit status of packing with `b`, a failure if files were left out.
+auto skipped(const bar::bottle& b) -> int {
+  if (b.skipped() == 0)
+    return EXIT_SUCCESS;
+  std::cerr << std::format("{} files skipped.\n", b.skipped());
+  return EXIT_FAILURE;
+}
+
+auto add(const fs::path& archive_file, const std::vector<fs::path>& inputs,
+         bar::pack_options opts) -> int {
+  auto out = bar::io::open_sink(open_archive(archive_file, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+                                archive_file);
+  bar::bottle b(*out, opts);
 
   for (const auto& input_path : inputs) {
     b.append(input_path);
   }
+  b.finish();
+
+  if (archive_file != "-")
+    std::cout << "archive '" << archive_file.string() << "' created.\n";
+  return skipped(b);
+}
+
+// Continues an existing archive, appending only what changed in `inputs`.
+auto update(const fs::path& archive_file, const std::vector<fs::path>& inputs,
+            bar::pack_options opts) -> int {
+  bar::io::fd_source in(bar::sys::open(archive_file, O_RDONLY), archive_file);
+  bar::opener op(in);
+
+  std::optional<bar::index> scanned;
+  if (!op.index())
+    scanned = op.scan();
+  const auto& previous = op.index() ? *op.index() : *scanned;
+
+  auto out_fd = bar::sys::open(archive_file, O_WRONLY);
+  const auto end = ::lseek(out_fd.get(), 0, SEEK_END);
+  bar::io::fd_sink out(std::move(out_fd), archive_file);
+  opts.format = op.format();  // appended entries must decode like the others
+  bar::bottle b(out, static_cast<uint64_t>(end), opts);
+  b.update(inputs, previous, in.fd());
+  b.finish();
+
+  std::cout << "archive '" << archive_file.string() << "' updated.\n";
+  return skipped(b);
+}
+
+// Extracts the entries matching `opts.scope`, everything when it is empty.
+// With an index, scanned for if a selection is made, only the live versions
+// of the matching paths are visited; otherwise every version is replayed in
+// order. A pipe is extracted in order, on one thread.
+auto extract(const fs::path& archive_file, const fs::path& dest_dir,
+             const bar::target_options& opts, size_t jobs, bar::stats* stats) -> int {
+  auto in = bar::io::open_source(open_archive(archive_file, O_RDONLY), archive_file);
+  bar::opener op(*in, stats);
+  bar::target dest(dest_dir, opts);
+  const auto& filter = opts.scope;
+
+  std::optional<bar::extractor> ex;
+  if (jobs != 1 && in->seekable()) {
+    ex.emplace(open_archive(archive_file, O_RDONLY), dest,
+               jobs ? jobs : bar::pool::concurrency(), stats);
+  }
+
+  uint64_t matched = 0;
+  auto unpack = [&](const bar::entry& entry, uint64_t offset) {
+    matched++;
+    if (ex)
+      ex->unpack(entry, offset);
+    else
+      op.unpack(entry, dest);
+  };
+
+  // a selection needs the index to find what its hard links point to
+  std::optional<bar::index> scanned;
+  if (!op.index() && in->seekable() && !filter.empty())
+    scanned = op.scan();
 
-  std::cout << "archive '" << archive_file.string() << "' created.\n";
+  if (const auto* index = op.index() ? op.index() : scanned ? &*scanned : nullptr) {
+    for (const auto& rec : index->records()) {
+      if (!index->is_live(rec) || !filter.matches(rec.path))
+        continue;
+      const auto& from = op.source_of(*index, rec, filter);
+      if (!ex)
+        op.seek(from);
+      unpack(bar::entry(fs::path(rec.path), from.header), from.offset);
+    }
+  } else {
+    while (auto entry_opt = op.next_entry()) {
+      const auto& entry = *entry_opt;
+      if (!filter.matches(entry.path().generic_string())) {
+        op.skip(entry);
+      } else if (ex) {
+        unpack(entry, op.tell());
+        op.skip(entry);
+      } else {
+        unpack(entry, 0);
+      }
+    }
+  }
+  if (ex)
+    ex->wait();
+  {
+    bar::stats::timer meta(stats, bar::stats::phase::metadata);
+    dest.finish();
+  }
+
+  if (!filter.empty() && matched == 0) {
+    std::cerr << "no entries match in archive.\n";
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
 
-auto extract(const fs::path& archive_file, const fs::path& dest_dir) -> int {
-  fs::create_directories(dest_dir);
+// Writes the entries of `inputs` not matching `exclude` to a new archive,
+// copying their payloads as they are stored.
+auto merge(const fs::path& archive_file, const std::vector<fs::path>& inputs,
+           const bar::glob& exclude, bar::pack_options opts) -> int {
+  // indexes view their openers, which read their sources
+  struct input {
+    bar::io::fd_source in;
+    bar::opener op;
+    std::optional<bar::index> scanned;
 
-  std::ifstream in(archive_file, std::ios::binary);
-  bar::opener op(in);
-  while (auto entry_opt = op.next_entry()) {
-    op.unpack(*entry_opt, dest_dir);
+    explicit input(const fs::path& path) : in(bar::sys::open(path, O_RDONLY), path), op(in) {
+      if (!op.index())
+        scanned = op.scan();
+    }
+  };
+  std::deque<input> opened;
+  std::vector<bar::bottle::source> sources;
+  for (const auto& path : inputs) {
+    const auto& it = opened.emplace_back(path);
+    sources.push_back({it.in.fd(), it.op.index() ? *it.op.index() : *it.scanned});
   }
 
+  auto out = bar::io::open_sink(open_archive(archive_file, O_WRONLY | O_CREAT | O_TRUNC, 0644),
+                                archive_file);
+  bar::bottle b(*out, opts);
+  b.merge(sources, exclude);
+  b.finish();
+
+  if (archive_file != "-")
+    std::cout << "archive '" << archive_file.string() << "' created.\n";
   return EXIT_SUCCESS;
 }
 
 auto list(const fs::path& archive_file) -> int {
-  std::ifstream in(archive_file, std::ios::binary);
-  bar::opener op(in);
-  while (auto entry_opt = op.next_entry()) {
-    const auto& entry = *entry_opt;
-    std::cout << std::format("{} {}\t\t{}\n", (entry.is_dir() ? 'd' : '-'), entry.size(),
-                             entry.path().string());
-    op.skip(entry);
+  constexpr size_t BATCH = 64 << 10;
+
+  auto kind = [](bar::entry_type type) {
+    switch (type) {
+      case bar::entry_type::dir:
+        return 'd';
+      case bar::entry_type::sym:
+        return 'l';
+      case bar::entry_type::link:
+        return 'h';
+      default:
+        return '-';
+    }
+  };
+
+  auto in = bar::io::open_source(open_archive(archive_file, O_RDONLY), archive_file);
+  bar::opener op(*in);
+
+  // a batch of entries at a time, formatted into one buffer and written at once
+  bar::listing batch;
+  std::string lines;
+  while (op.list(batch, BATCH) > 0) {
+    for (size_t i = 0; i < batch.size(); ++i) {
+      std::format_to(std::back_inserter(lines), "{} {}\t\t{}\n", kind(batch.type(i)),
+                     batch.raw(i), batch.path(i));
+    }
+    std::cout.write(lines.data(), static_cast<std::streamsize>(lines.size()));
+    lines.clear();
+    batch.clear();
   }
+  std::cout.flush();
   return EXIT_SUCCESS;
 }
 
-auto main(int argc, char* argv[]) -> int {
-  std::ios_base::sync_with_stdio(false);
+// Checks every entry against its checksum, batches of entries in parallel.
+auto test(const fs::path& archive_file, size_t jobs) -> int {
+  constexpr size_t BATCH_SIZE = 4 << 20;
+
+  bar::mapped ar(archive_file);
+  bar::pool pool(jobs);
+  std::mutex mutex;
+  std::vector<std::string> corrupt;
+  uint64_t checked = 0, unchecked = 0;
 
-  argh::parser cmdl({"-o", "--output"});
+  std::vector<bar::mapped::item> batch;
+  size_t batch_size = 0;
+  auto flush = [&] {
+    pool.submit([&, items = std::move(batch)] {
+      for (const auto& item : items) {
+        if (!item.intact()) {
+          std::lock_guard lock(mutex);
+          corrupt.push_back(item.entry.path().string());
+        }
+      }
+    });
+    batch.clear();
+    batch_size = 0;
+  };
+
+  while (auto item = ar.next()) {
+    if (!item->entry.is_reg())
+      continue;
+    if (!item->crc) {
+      unchecked++;
+      continue;
+    }
+    checked++;
+    batch_size += item->data.size();
+    batch.push_back(std::move(*item));
+    if (batch_size >= BATCH_SIZE)
+      flush();
+  }
+  if (!batch.empty())
+    flush();
+  pool.wait();
+
+  std::ranges::sort(corrupt);
+  for (const auto& path : corrupt) {
+    std::cerr << "'" << path << "': checksum mismatch.\n";
+  }
+  if (!ar.at_end())
+    std::cerr << "archive '" << archive_file.string() << "' is truncated.\n";
+  std::cout << std::format("{} files checked, {} corrupt, {} without checksum.\n", checked,
+                           corrupt.size(), unchecked);
+  return corrupt.empty() && ar.at_end() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+auto run(int argc, char* argv[]) -> int {
+  argh::parser cmdl({"-o", "--output", "-j", "--jobs", "--format", "--exclude"});
   cmdl.parse(argc, argv);
 
   if (cmdl[{"-h", "--help"}]) {
@@ -67,7 +299,10 @@ auto main(int argc, char* argv[]) -> int {
     return EXIT_SUCCESS;
   }
 
-  const auto& pos_args = cmdl.pos_args();
+  auto pos_args = cmdl.pos_args();
+  // argh takes a lone `-` for a flag, it can only be the archive
+  if (cmdl["-"] && pos_args.size() >= 2)
+    pos_args.insert(pos_args.begin() + 2, "-");
   if (pos_args.size() < 2) {
     std::cerr << "error: no command specified.\n" << USAGE;
     return EXIT_FAILURE;
@@ -75,6 +310,28 @@ auto main(int argc, char* argv[]) -> int {
 
   const auto& command = pos_args[1];
 
+  std::optional<bar::stats> stats;
+  std::string stats_mode;
+  if (cmdl["--stats"] || cmdl("--stats") >> stats_mode)
+    stats.emplace();
+  auto report = [&](int rc) {
+    if (stats)
+      std::cerr << (stats_mode == "json" ? stats->json() + '\n' : stats->text());
+    return rc;
+  };
+
+  // `--format` into `opts`, false after reporting an unknown one
+  auto read_format = [&](bar::pack_options& opts) {
+    int format;
+    cmdl("--format", 2) >> format;
+    if (format != 1 && format != 2) {
+      std::cerr << "unknown format " << format << ".\n";
+      return false;
+    }
+    opts.format = static_cast<bar::format>(format);
+    return true;
+  };
+
   if (command == "a") {
     if (pos_args.size() < 4) {
       std::cerr << "add requires at least one file to add.\n";
@@ -85,18 +342,67 @@ auto main(int argc, char* argv[]) -> int {
     for (size_t i = 3; i < pos_args.size(); ++i) {
       inputs.emplace_back(pos_args[i]);
     }
-    return add(archive_file, inputs);
+    bar::pack_options opts;
+    cmdl({"-j", "--jobs"}, 0) >> opts.jobs;
+    if (!opts.jobs)
+      opts.jobs = bar::pool::concurrency();
+    opts.compress = cmdl[{"-z", "--compress"}];
+    opts.dedup = cmdl[{"-d", "--dedup"}];
+    opts.checksum = cmdl[{"-c", "--checksum"}];
+    opts.align = cmdl[{"-a", "--align"}];
+    opts.stats = stats ? &*stats : nullptr;
+    opts.on_skip = [](std::string_view path, std::string_view why) {
+      std::cerr << "'" << path << "': " << why << ", skipped.\n";
+    };
+    if (!read_format(opts))
+      return EXIT_FAILURE;
+    if (cmdl[{"-u", "--update"}] && archive_file != "-" && fs::exists(archive_file))
+      return report(update(archive_file, inputs, opts));
+    return report(add(archive_file, inputs, opts));
+  }
+
+  if (command == "m") {
+    if (pos_args.size() < 4) {
+      std::cerr << "merge requires at least one archive to merge.\n";
+      return EXIT_FAILURE;
+    }
+    fs::path archive_file = pos_args[2];
+    std::vector<fs::path> inputs;
+    for (size_t i = 3; i < pos_args.size(); ++i) {
+      if (pos_args[i] == "-" ||
+          (fs::exists(archive_file) && fs::equivalent(pos_args[i], archive_file))) {
+        std::cerr << "merge requires named archives other than the output.\n";
+        return EXIT_FAILURE;
+      }
+      inputs.emplace_back(pos_args[i]);
+    }
+    std::vector<std::string> patterns;
+    for (const auto& param : cmdl.params("exclude")) {
+      patterns.push_back(param.second);
+    }
+    bar::pack_options opts;
+    opts.align = cmdl[{"-a", "--align"}];
+    opts.stats = stats ? &*stats : nullptr;
+    if (!read_format(opts))
+      return EXIT_FAILURE;
+    return report(merge(archive_file, inputs, bar::glob(patterns), opts));
   }
 
   if (command == "x") {
-    if (pos_args.size() != 3) {
-      std::cerr << "extract requires only archive name.\n";
+    if (pos_args.size() < 3) {
+      std::cerr << "extract requires archive name.\n";
       return EXIT_FAILURE;
     }
     fs::path archive_file = pos_args[2];
     fs::path output;
     cmdl({"-o", "--output"}, ".") >> output;
-    return extract(archive_file, output);
+    size_t jobs;
+    cmdl({"-j", "--jobs"}, 1) >> jobs;
+    bar::target_options opts;
+    opts.sync = cmdl["--sync"];
+    opts.prune = cmdl["--delete"];
+    opts.scope = bar::glob({pos_args.begin() + 3, pos_args.end()});
+    return report(extract(archive_file, output, opts, jobs, stats ? &*stats : nullptr));
   }
 
   if (command == "l") {
@@ -108,6 +414,33 @@ auto main(int argc, char* argv[]) -> int {
     return list(archive_file);
   }
 
+  if (command == "t") {
+    if (pos_args.size() != 3) {
+      std::cerr << "test requires only archive name.\n";
+      return EXIT_FAILURE;
+    }
+    fs::path archive_file = pos_args[2];
+    if (archive_file == "-") {
+      std::cerr << "test requires a named archive, it is mapped.\n";
+      return EXIT_FAILURE;
+    }
+    size_t jobs;
+    cmdl({"-j", "--jobs"}, 0) >> jobs;
+    return test(archive_file, jobs ? jobs : bar::pool::concurrency());
+  }
+
   std::cerr << "unknown command '" << command << "'.\n" << USAGE;
   return EXIT_FAILURE;
 }
+
+auto main(int argc, char* argv[]) -> int {
+  std::ios_base::sync_with_stdio(false);
+
+  try {
+    return run(argc, argv);
+  } catch (const std::exception& e) {
+    std::cout.flush();
+    std::cerr << "error: " << e.what() << '\n';
+    return EXIT_FAILURE;
+  }
+}